@@ -35,9 +35,7 @@
 static u_char *sect = (u_char*)0x7E00;	// scratch space
 static u_char* cga = (u_char*)0xb8000;
 
-/*
 void readsect(u_char*, u_int, u_int);
-*/
 void readseg(u_int, u_int, u_int);
 
 void
@@ -47,19 +45,13 @@ cmain(void)
 	struct Elf *elf;
 	struct Proghdr *ph;
 
-	sect = sect;
-	// read 1st page off disk
-	//readsect(sect, 8, 1);
-	
+	// read 1st page off disk; the kernel finds its section
+	// headers through the ELF header left here (see load_tables)
+	readsect(sect, 8, 1);
 
-	//if(*(u_int*)sect != 0x464C457F)	// \x7F ELF in little endian
-	//	return;
+	if(*(u_int*)sect != ELF_MAGIC)	// \x7F ELF in little endian
+		goto bad;
 
-        for(i = 0; (*(u_int*)sect != 0x464C457F) && i< 20; i++)
-	{
-	*cga++ = '%';
-	*cga++ = 7;
-	}
 	// look at ELF header - ignores ph flags
 	elf = (struct Elf*)sect;
 	entry = elf->e_entry;
@@ -67,24 +59,17 @@ cmain(void)
 	for(i=0; i<elf->e_phnum; i++, ph++)
 		readseg(ph->p_va, ph->p_memsz, ph->p_offset);
 
-	
-	// read section header
-
-	//sh_off = elf->e_shoff % 512;
-	//readseg(sh_addr + sh_off, elf->e_shentsize*elf->e_shnum, elf->e_shoff);
-
-	//sh_addr += sh_off; // data will be read from sector boundary, so add the offset to get the real address
-
-		
 	entry &= 0xFFFFFF;
 	((void(*)(void))entry)();
 	/* DOES NOT RETURN */
 
 bad:
-	//outw(0x8A00, 0x8A00);
-	//outw(0x8A00, 0x8E00);
+	for(i = 0; i < 20; i++)
+	{
+		*cga++ = '%';
+		*cga++ = 7;
+	}
 	for(;;);
-	
 }
 
 // read count bytes at offset from kernel into addr dst
@@ -92,60 +77,37 @@ bad:
 void
 readseg(u_int va, u_int count, u_int offset)
 {
-	u_int i, j;
+	u_int end;
 
 	va &= 0xFFFFFF;
+	end = va + count;
 
-	// round down to sector boundary; offset will round later
-	i = va&511;
-	count += i;
-	va -= i;
+	// round down to sector boundary
+	va &= ~(SECTOR_SIZE-1);
 
-	// translate from bytes to sectors
-	offset /= 512;
-	count = (count+511)/512;
-
-	// kernel starts at sector 1
-	//offset++;
+	// translate from bytes to sectors; kernel starts at sector 1
+	offset = offset/SECTOR_SIZE + 1;
 
 	// if this is too slow, we could read lots of sectors at a time.
 	// we'd write more to memory than asked, but it doesn't matter --
 	// we load in increasing order.
-	for(i=0; i<count; i++){
-
-		for(j = 0; j < 512; j++)
-		{
-			*((u_char*)va + j) = *((sect + offset*512 + i*512) + j);
-		}
-
-		va += 512;
+	while(va < end){
+		readsect((u_char*)va, 1, offset);
+		va += SECTOR_SIZE;
+		offset++;
 	}
 }
 
-/*
-void show_tag()
-{
-int i;
-	for(i = 0; i< 20; i++)
-	{
-		*cga++ = '#';
-		*cga++ = 7;
-	}
-
-
-}
-*/
-/*
 void
-notbusy(void)
+waitdisk(void)
 {
-	while(inb(0x1F7) & 0x80);	// wait for disk not busy
+	while((inb(0x1F7) & 0xC0) != 0x40);	// wait for disk ready
 }
 
 void
 readsect(u_char *dst, u_int count, u_int offset)
 {
-	notbusy();
+	waitdisk();
 
 	outb(0x1F2, count);
 	outb(0x1F3, offset);
@@ -154,9 +116,7 @@ readsect(u_char *dst, u_int count, u_int offset)
 	outb(0x1F6, (offset>>24)|0xE0);
 	outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
 
-	notbusy();
+	waitdisk();
 
-	insl(0x1F0, dst, count*512/4);
+	insl(0x1F0, dst, count*SECTOR_SIZE/4);
 }
-
-*/
@@ -0,0 +1,24 @@
+#ifndef _DISK_H_
+#define _DISK_H_
+
+#include <inc/types.h>
+
+/*
+ * Programmed-I/O access to the disks on the primary IDE channel,
+ * lib/disk.c.  Disk 0 is the master (the boot disk), disk 1 the
+ * slave.  Sectors are SECTSIZE bytes, addressed with 28-bit LBAs.
+ */
+#define SECTSIZE	512
+
+/* status register bits */
+#define IDE_BSY		0x80
+#define IDE_DRDY	0x40
+#define IDE_DF		0x20
+#define IDE_DRQ		0x08
+#define IDE_ERR		0x01
+
+u_int ide_nsectors(u_int diskno);
+int   ide_read(u_int diskno, u_int secno, void *dst, u_int nsecs);
+int   ide_write(u_int diskno, u_int secno, const void *src, u_int nsecs);
+
+#endif /* _DISK_H_ */
@@ -0,0 +1,40 @@
+#ifndef _E820_H_
+#define _E820_H_
+
+/*
+ * The BIOS memory map, as collected by boot/boot.S with
+ * int 0x15, %eax = 0xe820 while still in real mode.
+ *
+ * The boot loader leaves it at physical address E820_MAP: a 32-bit
+ * entry count followed by that many 20-byte entries.  A count of 0
+ * means the BIOS does not support the call.
+ */
+#define E820_MAP	0x5000	/* physical address of the map */
+#define E820_MAX	32	/* most entries the boot loader stores */
+#define E820_SIZE	20	/* bytes per entry */
+#define E820_SMAP	0x534d4150	/* 'SMAP', the call's signature */
+
+/* entry types */
+#define E820_RAM	1	/* usable memory */
+#define E820_RESERVED	2
+#define E820_ACPI	3	/* ACPI tables, reclaimable */
+#define E820_NVS	4
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+struct E820_entry {
+	u_int64_t e_addr;
+	u_int64_t e_len;
+	u_int e_type;
+} __attribute__((packed));
+
+struct E820_map {
+	u_int m_nr;
+	struct E820_entry m_entry[E820_MAX];
+} __attribute__((packed));
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* _E820_H_ */
@@ -8,14 +8,24 @@
 #include <inc/trap.h>
 #include <inc/pmap.h>
 
-#define LOG2NENV		10
+// An envid keeps its env's index in the low LOG2NENV bits, so NENV
+// bounds how many environments there can ever be.  The kernel sizes
+// the real table, envs[0..nenv-1], from the amount of memory at boot.
+#define LOG2NENV		15
 #define NENV			(1<<LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
+// The bits above the index, short of the sign bit, hold a generation
+// number.  mkenvid wraps it in 1..ENV_NGEN, so an envid is never
+// negative and never 0.
+#define ENV_NGEN		((1 << (31 - 1 - LOG2NENV)) - 1)
 
 // Values of env_status in struct Env
 #define ENV_FREE		0
 #define ENV_RUNNABLE		1
 #define ENV_NOT_RUNNABLE	2
+#define ENV_DYING		3	// destroyed, memory not all freed yet
+
+LIST_HEAD(Vma_list, Vma);
 
 struct Env {
 	struct Trapframe env_tf;        // Saved registers
@@ -26,7 +36,8 @@ struct Env {
 
 	// Address space
 	Pde  *env_pgdir;                // Kernel virtual address of page dir
-	u_int env_cr3;                  // Physical address of page dir
+	u_int env_cr3;                  // Physical address of page dir (PDPT with PAE)
+	struct Vma_list env_vmas;	// Regions filled in on demand
 
 	// Exception handling
 	u_int env_pgfault_entry;	// page fault state
@@ -38,6 +49,11 @@ struct Env {
 	u_int env_ipc_dstva;		// va at which to map received page
 	u_int env_ipc_perm;		// perm of page mapping received
 
+	// Working set, sampled from the clock interrupt (kern/ws.h)
+	u_int env_ws;			// aging estimate, in pages
+	u_int env_ws_ref;		// pages accessed in the last sample
+	u_int env_ws_dirty;		// pages written in the last sample
+	u_int env_rss;			// user pages mapped at the last sample
 };
 
 #endif // !_ENV_H_
@@ -13,7 +13,8 @@
 				// the maximum allowed
 #define E_IPC_NOT_RECV  6	// Attempt to send to env that is not recving.
 #define E_EOF		7	// Unexpected end of file
+#define E_NOT_FOUND	8	// No such program
 
-#define MAXERROR 7
+#define MAXERROR 8
 
 #endif // _ERROR_H_
@@ -42,12 +42,18 @@ void	sys_yield(void);
 int	sys_mem_alloc(u_int, u_int, u_int);
 int	sys_mem_map(u_int, u_int, u_int, u_int, u_int);
 int	sys_mem_unmap(u_int, u_int);
+int	sys_mem_alloc_range(u_int, u_int, u_int, u_int);
+int	sys_mem_map_vec(u_int, u_int, struct Mem_mapvec*, u_int);
+int	sys_mem_unmap_range(u_int, u_int, u_int);
 // int	sys_env_alloc(void);
 int	sys_set_trapframe(u_int, struct Trapframe*);
 int	sys_set_status(u_int, u_int);
 int	sys_set_pgfault_entry(u_int, u_int);
 int	sys_ipc_can_send(u_int, u_int, u_int, u_int);
 void	sys_ipc_recv(u_int);
+int	sys_fork(void);
+int	sys_spawn(const char*, char**);
+int	sys_vm_reserve(u_int va, u_int len, u_int perm);
 
 // This must be inlined.  
 // Exercise for reader: why?
@@ -69,8 +75,8 @@ void	ipc_send(u_int whom, u_int val, u_int srcva, u_int perm);
 u_int	ipc_recv(u_int *whom, u_int dstva, u_int *perm);
 
 // fork.c
-#define	PTE_LIBRARY	0x400
 int	fork(void);
+int	ufork(void);
 int	sfork(void);	// Challenge!
 
 
@@ -16,14 +16,37 @@
  *  | Page Directory |   Page Table   | Offset within Page  |
  *  |      Index     |      Index     |                     |
  *  +----------------+----------------+---------------------+
+ *
+ * With PAE, entries are 64 bits wide and a table holds only 512 of
+ * them, so there is a third level: the top two bits of the address
+ * pick one of four page directories from the page directory pointer
+ * table (PDPT) that CR3 points to.
+ *  +-2-+-----9------+-------9--------+---------12----------+
+ *  |PDP| Page Dir.  |   Page Table   | Offset within Page  |
+ *  +---+------------+----------------+---------------------+
+ * The kernel allocates the four page directories contiguously and
+ * treats them as one 2048-entry directory, so PDX covers both
+ * the PDPT index and the directory index.
  */
 
+#ifdef PAE
+
+// page directory index
+#define PDX(va)		((((u_long)(va))>>21) & 0x07FF)
+
+// page table index
+#define PTX(va)		((((u_long)(va))>>12) & 0x01FF)
+
+#else
+
 // page directory index
 #define PDX(va)		((((u_long)(va))>>22) & 0x03FF)
 
 // page table index
 #define PTX(va)		((((u_long)(va))>>12) & 0x03FF)
 
+#endif
+
 // page number field of address
 #define PPN(va)		(((u_long)(va))>>12)
 #define VPN(va)		PPN(va)
@@ -31,15 +54,33 @@
 // offset in page
 #define PGOFF(va)		(((u_long)(va)) & 0xFFF)
 
-#define PDE2PD		1024		// page directory entries to a (per) page directory
-#define PTE2PT		1024		// page table entries to a page table
 #define BY2PG		4096		// bytes to a page
 #define PGSHIFT		12		// log(BY2PG)
 
+#ifdef PAE
+
+#define PDE2PD		2048		// page directory entries, all four directories
+#define PTE2PT		512		// page table entries to a page table
+#define PDPTE2PDPT	4		// entries in the page directory pointer table
+
+#define PDMAP		(2*1024*1024)	// bytes mapped by a page directory entry
+#define PDSHIFT		21		// log2(PDMAP)
+
+#else
+
+#define PDE2PD		1024		// page directory entries to a (per) page directory
+#define PTE2PT		1024		// page table entries to a page table
+
 // PDMAP is a crummy name, but I can't think of a better one.  -rsc
 #define PDMAP		(4*1024*1024)	// bytes mapped by a page directory entry
 #define PDSHIFT		22		// log2(PDMAP)
 
+#endif
+
+// bytes of virtual address space that the page tables, viewed
+// through the page directory itself, take up (see VPT)
+#define VPTSIZE		(PDE2PD / PTE2PT * PDMAP)
+
 
 /* At IOPHYSMEM (640K) there is a 384K hole for I/O.  From the kernel,
  * IOPHYSMEM can be addressed at KERNBASE + IOPHYSMEM.  The hole ends
@@ -58,16 +99,34 @@
 #define PTE_A		0x020	// Accessed
 #define PTE_D		0x040	// Dirty
 #define PTE_PS		0x080	// Page Size
+#define PTE_G		0x100	// Global
 #define PTE_MBZ		0x180	// Bits must be zero
 #define PTE_AVAIL	0xe00	// Available for software use
+#define PTE_LIBRARY	0x400	// Shared, even writable, across fork
+#define PTE_COW		0x800	// Copy-on-write: copied on the first write
+#define PTE_SWAPPED	0x200	// Not present: out in swap slot PTE_ADDR>>PGSHIFT
 // There's no good reason to use this.  Use PTE_USER.
 // #define PTE_FLAGS	0xfff	// All flags
 
-#define PTE_USER	0xe07	// All flags that can be used in system calls
+// All flags that can be used in system calls.  Not PTE_SWAPPED: only
+// the kernel may say where a page is in swap.
+#define PTE_USER	0xc07
 
 // address in page table entry
 #define PTE_ADDR(pte)	((u_long)(pte)&~0xFFF)
 
+// physical page number in page table entry: up to 36 bits of
+// physical address with PAE, which PTE_ADDR would cut down to 32
+#ifdef PAE
+#define PTE_PPN(pte)	((u_long)((u_int64_t)(pte) >> PGSHIFT) & 0xFFFFFF)
+#else
+#define PTE_PPN(pte)	(((u_long)(pte)) >> PGSHIFT)
+#endif
+
+// address in a superpage (PTE_PS) page directory entry:
+// 4MB pages, or 2MB ones with PAE
+#define PTE_ADDR_PS(pde)	((u_long)(pde)&~(PDMAP-1))
+
 /*
  * The PG_USER bits are not used by the kernel and they are
  * not interpreted by the hardware.  The kernel allows 
@@ -88,6 +147,8 @@
 #define CR0_PG 0x80000000      // Paging
 
 #define CR4_PCE 0x100          // Performance counter enable
+#define CR4_PGE 0x80           // Page Global Enable
+#define CR4_PAE 0x20           // Physical Address Extension
 #define CR4_MCE 0x40           // Machine Check Enable
 #define CR4_PSE 0x10           // Page Size Extensions
 #define CR4_DE  0x08           // Debugging Extensions
@@ -95,6 +156,11 @@
 #define CR4_PVI 0x02           // Protected-Mode Virtual Interrupts
 #define CR4_VME 0x01           // V86 Mode Extensions
 
+// CPUID function 1 feature flags (in %edx)
+#define CPUID_FEAT_PSE 0x08    // Page Size Extensions
+#define CPUID_FEAT_PAE 0x40    // Physical Address Extension
+#define CPUID_FEAT_PGE 0x2000  // Page Global Enable
+
 // Eflags register
 #define FL_CF 0x1              // Carry Flag
 #define FL_PF 0x4              // Parity Flag
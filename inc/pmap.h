@@ -34,17 +34,19 @@
  *                     |  Physical Memory             | RW/--
  *                     |                              | RW/--
  *    KERNBASE ----->  +------------------------------+ 0xf0000000
- *                     |  Kernel Virtual Page Table   | RW/--    PDMAP
+ *                     |  Kernel Virtual Page Table   | RW/--  VPTSIZE
  *    VPT,KSTACKTOP--> +------------------------------+ 0xefc00000      --+
  *                     |        Kernel Stack          | RW/--  KSTKSIZE   |
  *                     | - - - - - - - - - - - - - - -|                 PDMAP
  *                     |       Invalid memory         | --/--             |
+ *                     | - - - - - - - - - - - - - - -|                   |
+ *                     |  page_kmap() slots (PAE)     | RW/--             |
  *    ULIM     ------> +------------------------------+ 0xef800000      --+
- *                     |      R/O User VPT            | R-/R-    PDMAP
+ *                     |      R/O User VPT            | R-/R-  VPTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
- *                     |        R/O PAGES             | R-/R-    PDMAP
+ *                     |        R/O PAGES             | R-/R-  UPAGESIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |        R/O ENVS              | R-/R-    PDMAP
+ *                     |        R/O ENVS              | R-/R-  UENVSIZE
  * UTOP,UENVS -------> +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |      user exception stack    | RW/RW   BY2PG  
  *                     +------------------------------+ 0xeebff000
@@ -74,23 +76,40 @@
  * the page directory itself, thereby turning the PD into a page table,
  * which maps all the PTEs containing the page mappings for the entire
  * virtual address space into that 4 Meg region starting at VPT.
+ * (With PAE the four page directories take four entries, and the
+ * region is 8 Meg.)
  */
-#define VPT (KERNBASE - PDMAP)
+#define VPT (KERNBASE - VPTSIZE)
 #define KSTACKTOP VPT
 #define KSTKSIZE (8 * BY2PG)   		// size of a kernel stack
 #define ULIM (KSTACKTOP - PDMAP) 
 
+#ifdef PAE
+// Highmem pages, above the KERNBASE window, have no kernel address;
+// page_kmap() maps them for the kernel at these slots under the
+// stack.  ULIM itself stays unmapped.
+#define KMAPBASE (ULIM + BY2PG)
+#define KMAP_NSLOT 4
+#endif
+
 /*
  * User read-only mappings! Anything below here til UTOP are readonly to user.
  * They are global pages mapped in at env allocation time.
  */
 
 // Same as VPT but read-only for users
-#define UVPT (ULIM - PDMAP)
-// Read-only copies of all ppage structures
-#define UPAGES (UVPT - PDMAP)
-// Read only copy of the global env structures
-#define UENVS (UPAGES - PDMAP)
+#define UVPT (ULIM - VPTSIZE)
+// Read-only copies of all ppage structures, which with PAE also
+// describe highmem
+#ifdef PAE
+#define UPAGESIZE (32 * PDMAP)
+#else
+#define UPAGESIZE PDMAP
+#endif
+#define UPAGES (UVPT - UPAGESIZE)
+// Read only copy of the global env structures, room for 16K+ of them
+#define UENVSIZE (4*1024*1024)
+#define UENVS (UPAGES - UENVSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -99,6 +118,7 @@
 #define UXSTACKTOP (UTOP)           // one page user exception stack
 // leave top page invalid to guard against exception stack overflow 
 #define USTACKTOP (UTOP - 2*BY2PG)   // top of the normal user stack
+#define USTACKSIZE (256*BY2PG)      // most the user stack grows to
 #define UTEXT (2*PDMAP)
 
 
@@ -115,8 +135,13 @@
  * always be available at virtual address(VPT+(VPT>>PGSHIFT)), to
  * which vpd is set in entry.S.
  */
+#ifdef PAE
+typedef u_int64_t Pte;
+typedef u_int64_t Pde;
+#else
 typedef u_long Pte;
 typedef u_long Pde;
+#endif
 
 extern volatile Pte vpt[];     // VA of "virtual page table"
 extern volatile Pde vpd[];     // VA of current page directory
@@ -138,7 +163,41 @@ struct Page {
 	// do not have valid reference count fields.
 
 	u_short pp_ref;
+
+	// Buddy allocator state.  pp_order is the order of the block
+	// this page heads (2^pp_order pages); pp_free is set only while
+	// the page heads a block sitting on one of the free lists.
+	u_char pp_order;
+	u_char pp_free;
+
+	// If this page is a user page table (below UTOP), the number
+	// of present or swapped-out entries in it.  The table is freed when this
+	// drops to 0.
+	// If it is a page directory, the number of user page tables
+	// installed in it, and in pp_ptmap a bit for each group of
+	// PGDIR_CHUNK page directory entries that may hold one.
+	u_short pp_ptes;
+
+	// Accessed and dirty bits that one scanner cleared out of this
+	// page's PTEs, kept for the others to see (PG_* below).
+	u_char pp_flags;
+
+	// If it is a user page table shared since fork, pp_ptmap is
+	// instead the ws_tick() lap that last counted it (kern/ws.c).
+	u_int pp_ptmap;
+
+	// The user mappings of this page, one struct Rmap for each
+	// PTE below UTOP that maps it (kern/rmap.c).
+	struct Rmap *pp_rmap;
 };
 
+// pp_flags, one bit per scanner and PTE bit
+#define PG_SWAP_A	0x1	// for swap_out(): PTE_A was set
+#define PG_KSM_D	0x2	// for ksm_scan(): PTE_D was set
+#define PG_WS_A		0x4	// for ws_tick(): PTE_A was set
+#define PG_WS_D		0x8	// for ws_tick(): PTE_D was set
+#define PG_WS_SA	0x10	// for ws_tick(): a shared table's later
+#define PG_WS_SD	0x20	//   sharers, what the first one counted
+
 #endif /* not __ASSEMBLER__ */
 #endif /* not _PMAP_H_ */
@@ -12,5 +12,6 @@ long		strtol(const char *s, char **endptr, int base);
 
 void *		memset(void *dest, int, size_t len);
 void *		memcpy(void *dest, const void *src, size_t len);
+int		memcmp(const void *s1, const void *s2, size_t len);
 
 #endif /* not _INC_STRING_H_ */
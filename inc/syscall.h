@@ -21,8 +21,23 @@ enum
 	SYS_set_pgfault_entry,
 	SYS_ipc_can_send,
 	SYS_ipc_recv,
+	SYS_fork,
+	SYS_mem_alloc_range,
+	SYS_mem_map_vec,
+	SYS_mem_unmap_range,
+	SYS_spawn,
+	SYS_vm_reserve,
 
 	NSYSCALLS,
 };
 
+// One page mapping for sys_mem_map_vec: the page at mv_srcva in the
+// source environment goes to mv_dstva in the destination, with
+// permission mv_perm.
+struct Mem_mapvec {
+	u_int mv_srcva;
+	u_int mv_dstva;
+	u_int mv_perm;
+};
+
 #endif /* !_SYSCALL_H_ */
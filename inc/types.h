@@ -34,6 +34,13 @@ typedef uint32_t        size_t;
 		__a <= __b ? __a : __b;	\
 	})
 
+#define MAX(_a, _b)	\
+	({		\
+		typeof(_a) __a = (_a);	\
+		typeof(_b) __b = (_b);	\
+		__a >= __b ? __a : __b;	\
+	})
+
 /* Static assert, for compile-time assertion checking */
 #define static_assert(c) switch (c) case 0: case(c):
 
@@ -218,6 +218,14 @@ read_esp(void)
         return(v);
 }
 
+static __inline u_int64_t
+read_tsc(void)
+{
+	u_int64_t tsc;
+	__asm __volatile("rdtsc" : "=A" (tsc));
+	return tsc;
+}
+
 static __inline void
 cpuid(u_int info, u_int *eaxp, u_int *ebxp, u_int *ecxp, u_int *edxp)
 {
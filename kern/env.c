@@ -12,12 +12,42 @@
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
+#include <kern/image.h>
+#include <kern/vma.h>
+#include <kern/swap.h>
+#include <kern/rmap.h>
 
 struct Env *envs = NULL;		// All environments
 struct Env *curenv = NULL;	        // The current env
+u_int nenv;				// Number of entries in envs
 
 static struct Env_list env_free_list;	// Free list
 
+// Destroyed environments waiting for env_reap(), and the one it is
+// part way through, with the page directory entry it got to.
+static struct Env_list env_zombie_list;
+static struct Env *env_reaping;
+static u_int env_reap_pdx;
+
+// The user programs linked into the kernel.  KERN_BINARIES(_) is
+// defined on the command line from KERN_BINFILES in kern/Makefrag.
+#define BINARY_EXTERN(x) \
+	extern u_char _binary_obj_user_##x##_start[], \
+		_binary_obj_user_##x##_size[];
+#define BINARY_ENTRY(x) \
+	{ #x, _binary_obj_user_##x##_start, _binary_obj_user_##x##_size },
+
+KERN_BINARIES(BINARY_EXTERN)
+
+static struct Binary {
+	const char *b_name;
+	u_char *b_start;
+	u_char *b_size;		// an absolute symbol: the value is the size
+} binaries[] = {
+	KERN_BINARIES(BINARY_ENTRY)
+};
+#define NBINARIES (sizeof(binaries)/sizeof(binaries[0]))
+
 //
 // Calculates the envid for env e.  
 //
@@ -27,8 +57,10 @@ mkenvid(struct Env *e)
 	static u_long next_env_id = 0;
 	// lower bits of envid hold e's position in the envs array
 	u_int idx = e - envs;
-	// high bits of envid hold an increasing number
-	return(++next_env_id << (1 + LOG2NENV)) | idx;
+	// high bits of envid hold an increasing number, wrapped
+	// before it reaches the sign bit
+	next_env_id = next_env_id % ENV_NGEN + 1;
+	return(next_env_id << (1 + LOG2NENV)) | idx;
 }
 
 //
@@ -56,8 +88,13 @@ envid2env(u_int envid, struct Env **penv, int checkperm)
 	// to ensure that the envid is not stale
 	// (i.e., does not refer to a _previous_ environment
 	// that used the same slot in the envs[] array).
+	if (ENVX(envid) >= nenv) {
+		*penv = 0;
+		return -E_BAD_ENV;
+	}
 	e = &envs[ENVX(envid)];
-	if (e->env_status == ENV_FREE || e->env_id != envid) {
+	if (e->env_status == ENV_FREE || e->env_status == ENV_DYING
+	    || e->env_id != envid) {
 		*penv = 0;
 		return -E_BAD_ENV;
 	}
@@ -67,8 +104,8 @@ envid2env(u_int envid, struct Env **penv, int checkperm)
 	// If checkperm is set, the specified environment
 	// must be either the current environment
 	// or an immediate child of the current environment.
-	if (checkperm) {
-		// Your code here in Lab 4
+	if (checkperm && e != curenv && e->env_parent_id != curenv->env_id) {
+		*penv = 0;
 		return -E_BAD_ENV;
 	}
 	*penv = e;
@@ -86,9 +123,12 @@ env_init(void)
 	int i;
 
 	LIST_INIT(&env_free_list);
+	LIST_INIT(&env_zombie_list);
 
-	for( i = 0; i < NENV; i++)
+	for (i = nenv - 1; i >= 0; i--)
 		LIST_INSERT_HEAD(&env_free_list, &envs[i], env_link);
+
+	vma_init();
 }
 
 //
@@ -107,40 +147,48 @@ static int
 env_setup_vm(struct Env *e)
 {
 	int i, r;
-	struct Page *p = NULL, *p1 = NULL, *p2 = NULL;
+	struct Page *p1 = NULL, *p2 = NULL;
 	Pte *pTable = NULL;
 	u_long uStackBottom = USTACKTOP - BY2PG;
 
-	// Allocate a page for the page directory
-	if ((r = page_alloc(&p)) < 0)
+	// Allocate the page directory.
+	// Everything below UTOP starts out unmapped.
+	if ((r = pgdir_alloc(&e->env_pgdir, &e->env_cr3)) < 0)
 		return r;
 
-
-	e->env_pgdir = KADDR(page2pa(p));
-	e->env_cr3 = page2pa(p);
-
-	printf("setupvm:cr3=%x\n", e->env_cr3);
-
-	memcpy(e->env_pgdir, boot_pgdir, BY2PG); // dangeous
+	// The kernel part is shared; its entries are global, so they
+	// stay in the TLB when env_run switches to this page directory.
+	for (i = PDX(UTOP); i < PDE2PD; i++)
+		e->env_pgdir[i] = boot_pgdir[i];
 
 	// map user statck
-	if ((r = page_alloc(&p1)) < 0)
+	if (( r = page_alloc_user_zeroed(&p2)) < 0)
 	{
-		page_free(p1);
+		pgdir_free(e->env_pgdir, e->env_cr3);
 		return r;
 	}
-	
-	pTable = (Pte*)KADDR( page2pa(p1) );
-	e->env_pgdir[ PDX(uStackBottom) ] = page2pa(p1) | PTE_U |PTE_W| PTE_P;
 
-	if (( r = page_alloc(&p2)) < 0)
+	if ((r = rmap_add(p2, e->env_pgdir, uStackBottom)) < 0)
 	{
-		page_free(p1);
 		page_free(p2);
+		pgdir_free(e->env_pgdir, e->env_cr3);
 		return r;
 	}
 
-	pTable[ PTX(uStackBottom) ] = page2pa(p2) | PTE_U | PTE_W | PTE_P;
+	if ((r = page_table_alloc(&p1)) < 0)
+	{
+		rmap_remove(p2, e->env_pgdir, uStackBottom);
+		page_free(p2);
+		pgdir_free(e->env_pgdir, e->env_cr3);
+		return r;
+	}
+
+	pTable = (Pte*)KADDR( page2pa(p1) );
+	page_table_insert(e->env_pgdir, PDX(uStackBottom), p1);
+
+	pTable[ PTX(uStackBottom) ] = page2pte(p2) | PTE_U | PTE_W | PTE_P;
+	p1->pp_ptes = 1;
+	p2->pp_ref = 1;
 
 	// map UTEXT address space
 	/*
@@ -172,8 +220,7 @@ env_setup_vm(struct Env *e)
 
 
 	// ...except at VPT and UVPT.  These map the env's own page table
-	e->env_pgdir[PDX(VPT)]   = e->env_cr3 | PTE_P | PTE_W;
-	e->env_pgdir[PDX(UVPT)]  = e->env_cr3 | PTE_P | PTE_U;
+	pgdir_map_vpt(e->env_pgdir);
 
 	return 0;
 }
@@ -191,7 +238,11 @@ env_alloc(struct Env **new, u_int parent_id)
 	int r;
 	struct Env *e;
 
-	if (!(e = LIST_FIRST(&env_free_list)))
+	// a slot a destroyed env still holds is worth waiting for
+	while (!(e = LIST_FIRST(&env_free_list))
+	    && (env_reaping || !LIST_EMPTY(&env_zombie_list)))
+		env_reap(ENV_REAP_IDLE);
+	if (e == 0)
 		return -E_NO_FREE_ENV;
 
 	// Allocate and set up the page directory for this environment.
@@ -221,92 +272,49 @@ env_alloc(struct Env **new, u_int parent_id)
 	e->env_tf.tf_ss = GD_UD | 3;
 	e->env_tf.tf_esp = USTACKTOP;
 	e->env_tf.tf_cs = GD_UT | 3;
+	// Take clock interrupts while in user mode.
+	e->env_tf.tf_eflags = FL_IF;
 
 
 	// You also need to set tf_eip to the correct value at some point.
 	// Hint: see load_icode
 
+	// No regions yet.
+	LIST_INIT(&e->env_vmas);
+
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_entry = 0;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
+	// Nothing of the working set seen yet.
+	e->env_ws = 0;
+	e->env_ws_ref = 0;
+	e->env_ws_dirty = 0;
+	e->env_rss = 0;
+
 
 	// commit the allocation
 	LIST_REMOVE(e, env_link);
 	*new = e;
 
-	printf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
-	return 0;
-}
-
-// Allocate and map all required pages into an env's address space
-// to cover virtual addresses va through va+len-1 inclusive.
-// Does not zero or otherwise initialize the mapped pages in any way.
-// Panic if any allocation attempt fails.
-//
-// Warning: Neither va nor len are necessarily page-aligned!
-// You may assume, however, that nothing is already mapped
-// in the pages touched by the specified virtual address range.
-static void
-map_segment(struct Env *e, u_int va, u_int len)
-{
-	// Your code here. simplely assuming len < 4M, and the new entry for the mapped va is not in use
-	struct Page *p;
-	int pdx = PDX(va);
-	int ptx = PTX(va);
-	int pages = ROUND(len, BY2PG) / BY2PG;
-	int count = 0;
-	Pte *pTable, *pTableKern;
-
-	// map in kernel space to prepare the code for the Env
-	if (!(boot_pgdir[pdx] & PTE_P))
-	{
-		if (page_alloc(&p) < 0)
-			panic("Unable to allocat a page in map_segment()");
-
-
-		memset(KADDR(page2pa(p)), 0, BY2PG);
-		boot_pgdir[pdx] = page2pa(p) | PTE_W | PTE_P | PTE_U;
-	}
-	
-
-	// check the secondory table existence
-	if (!(e->env_pgdir[pdx] & PTE_P))
-	{
-		printf("The page for va:%x not exist.\n", va);
-		if (page_alloc(&p) < 0)
-			panic("Unable to allocat a page in map_segment()");
-
-		memset(KADDR(page2pa(p)), 0, BY2PG);
-		e->env_pgdir[pdx] = page2pa(p) | PTE_P | PTE_U | PTE_W;
+	// The stack page env_setup_vm mapped starts a region that
+	// grows down as the stack is used.
+	if ((r = vma_add(e, USTACKTOP - BY2PG, USTACKTOP,
+			PTE_U | PTE_W | PTE_P, VMA_GROWSDOWN, 0)) < 0) {
+		env_free(e);
+		return r;
 	}
-	else
-		printf("The entry exist for:%x and content is:%x\n", va, e->env_pgdir[pdx]);
-
-	pTable = (Pte*)KADDR(PTE_ADDR(e->env_pgdir[pdx]));
-	pTableKern = (Pte*)KADDR(PTE_ADDR(boot_pgdir[pdx]));
 
-	printf("Will alloate:%x page(s) for va:%x\n", pages, va);
-	// check if some pages for va is mapped
-	for( count = 0; count < pages; count++)
-	{
-		if (! (pTable[ptx+count] & PTE_P))
-		{
-			if(page_alloc(&p) < 0)
-				panic("Unable to allocat a page in map_segment()");
-			pTable[ptx+count] = page2pa(p) | PTE_P | PTE_U | PTE_W;
-			pTableKern[ptx+count] = page2pa(p) | PTE_P | PTE_W | PTE_U;
-		}
-	}
-	
+	printf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+	return 0;
 }
 
 //
 // Set up the the initial stack and program binary for a user process.
-// This function is ONLY called during kernel initialization,
-// before running the first user-mode environment.
+// This function is called during kernel initialization, before
+// running the first user-mode environment, and by env_spawn.
 //
 // This function loads all loadable segments from the ELF binary image
 // into the environment's user memory, starting at the appropriate
@@ -315,51 +323,55 @@ map_segment(struct Env *e, u_int va, u_int len)
 // that are marked in the program header as being mapped
 // but not actually present in the ELF file - i.e., the program's bss section.
 //
-// Finally, this function maps one page for the program's initial stack
-// at virtual address USTACKTOP - BY2PG.
+// Pages that only read-only segments cover are shared with every
+// other environment loaded from the same binary, through the image
+// cache.  The rest are private, and are not loaded here: each
+// segment becomes a region (see kern/vma.h), and its pages are
+// copied from the image, or zeroed for bss, on first touch.
 //
-static void
+// The program's initial stack page at USTACKTOP - BY2PG was already
+// mapped by env_setup_vm.
+//
+// RETURNS
+//   0 on success
+//   -E_INVAL, if the binary is not an ELF image that fits below UTOP
+//   -E_NO_MEM, if there is no memory
+//
+static int
 load_icode(struct Env *e, u_char *binary, u_int size)
 {
-	// Hint: 
-	//  Use map_segment() to map memory for each program segment.
-	//  Only use segments with ph->p_type == ELF_PROG_LOAD.
-	//  Each segment's virtual address can be found in ph->p_va
-	//  and its size in memory can be found in ph->p_memsz.
-	//  For each segment, load the first ph->p_filesz bytes from the ELF
-	//  binary and clear any remaining bytes in the segment to zero.
-	//
-	// Hint:
-	//  Loading the segments is much simpler if you set things up
-	//  so that you can access them via the user's virtual addresses!
-	
-	struct Elf *elfHeader = (struct Elf*)binary;
-	struct Proghdr *prgHeader = (struct Proghdr*)(binary + elfHeader->e_phoff);
-	u_short phNum = elfHeader->e_phnum;
-	int i = 0, count;
-	int pages, pdx, ptx;
-
-	printf("^^^^^^^^^^^^^^^^^^^^^^^^%x\n", *(int*)binary);
-	printf("icode Entry point is:%x\n", elfHeader->e_entry);
-	printf("Phnum is:%x\n", phNum);
-	for( ; i < phNum; i++)
-	{
-		printf("Pgr header type is:%x, addr=%x, size=%x\n", prgHeader->p_type, prgHeader->p_va, prgHeader->p_filesz);
-		if ( prgHeader->p_type == ELF_PROG_LOAD )
-		{
-			map_segment(e, prgHeader->p_va, prgHeader->p_memsz);
-
-			// map the physical address in kernel page dir
-			printf("contents in pa:%x\n", *(int*)prgHeader->p_va);
-			memcpy( prgHeader->p_va, binary + prgHeader->p_offset, prgHeader->p_filesz);
-			printf("First struction is:%x\n", *((int*)prgHeader->p_va));
-		}
+	struct Elf *elf = (struct Elf *)binary;
+	struct Proghdr *ph, *eph;
+	struct Image *im;
+	int r;
 
-		prgHeader++;
-	}
+	if (size < sizeof(struct Elf) || elf->e_magic != ELF_MAGIC)
+		return -E_INVAL;
+
+	ph = (struct Proghdr *)(binary + elf->e_phoff);
+	eph = ph + elf->e_phnum;
+	for (; ph < eph; ph++)
+		if (ph->p_type == ELF_PROG_LOAD
+		    && (ph->p_va >= UTOP || ph->p_memsz > UTOP - ph->p_va
+			|| ph->p_filesz > ph->p_memsz
+			|| ph->p_offset + ph->p_filesz > size))
+			return -E_INVAL;
+
+	// the shared pages are there already, so they never fault
+	if ((r = image_get(binary, &im)) < 0
+	    || (r = image_map(im, e->env_pgdir)) < 0)
+		return r;
 
-	e->env_tf.tf_eip = elfHeader->e_entry;
-	
+	ph = (struct Proghdr *)(binary + elf->e_phoff);
+	for (; ph < eph; ph++)
+		if (ph->p_type == ELF_PROG_LOAD && ph->p_memsz > 0
+		    && (r = vma_add(e, ROUNDDOWN(ph->p_va, BY2PG),
+				ROUND(ph->p_va + ph->p_memsz, BY2PG),
+				PTE_U | PTE_W, 0, binary)) < 0)
+			return r;
+
+	e->env_tf.tf_eip = elf->e_entry;
+	return 0;
 }
 
 //
@@ -370,59 +382,139 @@ load_icode(struct Env *e, u_char *binary, u_int size)
 void
 env_create(u_char *binary, int size)
 {
-	struct Env *env;
+	struct Env *e;
+	int r;
 
-	printf("User binaray addr=%x, size=%d\n", (int)binary, size);
+	if ((r = env_alloc(&e, 0)) < 0)
+		panic("env_create: %e", r);
+	if ((r = load_icode(e, binary, size)) < 0)
+		panic("env_create: %e", r);
+}
+
+//
+// Find the user program called name among those linked into the
+// kernel (KERN_BINFILES in kern/Makefrag).
+// Returns 0 if there is none.
+//
+static struct Binary *
+binary_lookup(const char *name)
+{
+	struct Binary *b;
 
-	int result = env_alloc(&env, 0);
+	for (b = binaries; b < binaries + NBINARIES; b++)
+		if (strcmp(b->b_name, name) == 0)
+			return b;
+	return 0;
+}
 
-	printf("allocated cr3=%x\n", env->env_cr3);
+//
+// Allocates a new env, with parent parent_id, and loads the user
+// program called name, which is linked into the kernel, into it.
+//
+// RETURNS
+//   0 on success, and sets *new to point at the new env
+//   -E_NOT_FOUND, if there is no such program
+//   <0 on other failures
+//
+int
+env_spawn(struct Env **new, const char *name, u_int parent_id)
+{
+	struct Binary *b;
+	struct Env *e;
+	int r;
 
-	load_icode(env, binary, size);
+	if ((b = binary_lookup(name)) == 0)
+		return -E_NOT_FOUND;
+	if ((r = env_alloc(&e, parent_id)) < 0)
+		return r;
+	if ((r = load_icode(e, b->b_start, (u_int)b->b_size)) < 0) {
+		env_free(e);
+		return r;
+	}
+	*new = e;
+	return 0;
 }
 
 //
-// Frees env e and all memory it uses.
-// 
-void
-env_free(struct Env *e)
+// Free the page tables of e's user address space and the pages they
+// map, starting at entry *ppdx of the page directory and stopping
+// after n tables.  Each table goes whole, so nothing walking the page
+// directory in between finds one half emptied.  Returns the number of
+// tables freed and leaves in *ppdx where to carry on, PDX(UTOP) once
+// all are gone.
+//
+static u_int
+env_free_tables(struct Env *e, u_int *ppdx, u_int n)
 {
 	Pte *pt;
-	u_int pdeno, pteno, pa;
-
-	// Note the environment's demise.
-	printf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+	u_int done, pdeno, pteno, left, pa;
+	struct Page *pgpp, *pp;
 
-	// Flush all mapped pages in the user portion of the address space
+	// visit only the page tables the page directory's summary says
+	// are there, and each only until it is empty
 	static_assert(UTOP%PDMAP == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+	pgpp = pa2page(PADDR(e->env_pgdir));
+	done = 0;
+	for (pdeno = *ppdx; pdeno < PDX(UTOP) && pgpp->pp_ptes > 0
+	    && done < n; pdeno++) {
+		if (pdeno % PGDIR_CHUNK == 0
+		    && !(pgpp->pp_ptmap & (1 << (pdeno / PGDIR_CHUNK)))) {
+			pdeno += PGDIR_CHUNK - 1;
+			continue;
+		}
 
 		// only look at mapped page tables
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
+		done++;
 
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (Pte*)KADDR(pa);
 
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir,
-					(pdeno << PDSHIFT) |
-					(pteno << PGSHIFT));
+		// a table still shared since fork keeps its pages
+		// for the others
+		if (pa2page(pa)->pp_ref > 1) {
+			page_table_disown(e->env_pgdir, pdeno);
+			page_table_free(e->env_pgdir, pdeno);
+			continue;
+		}
+
+		// drop the references of its live PTEs
+		left = pa2page(pa)->pp_ptes;
+		for (pteno = 0; pteno < PTE2PT && left > 0; pteno++) {
+			if (pt[pteno] & PTE_P) {
+				pp = pte2page(pt[pteno]);
+				rmap_remove(pp, e->env_pgdir,
+					pdeno * PDMAP + pteno * BY2PG);
+				page_decref(pp);
+				left--;
+			} else if (pt[pteno] & PTE_SWAPPED) {
+				swap_free(SWAP_SLOT(pt[pteno]));
+				left--;
+			}
 		}
 
 		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
+		page_table_free(e->env_pgdir, pdeno);
 	}
 
-	// free the page directory
-	pa = e->env_cr3;
+	*ppdx = pgpp->pp_ptes > 0 ? pdeno : PDX(UTOP);
+	return done;
+}
+
+//
+// Free what is left of env e once its user address space is empty,
+// and return it to the free list.
+//
+static void
+env_free_finish(struct Env *e)
+{
+	// free the page directory and the regions
+	pgdir_free(e->env_pgdir, e->env_cr3);
+	vma_free_all(e);
 	e->env_pgdir = 0;
 	e->env_cr3 = 0;
-	page_decref(pa2page(pa));
 
 	// return the environment to the free list
 	e->env_status = ENV_FREE;
@@ -430,13 +522,40 @@ env_free(struct Env *e)
 }
 
 //
-// Frees env e.  And schedules a new env
+// Frees env e and all memory it uses, right away.
+// 
+void
+env_free(struct Env *e)
+{
+	u_int pdx = 0;
+
+	// Note the environment's demise.
+	printf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+
+	// Switch away from this address space before taking it apart.
+	// Its user mappings are not global, so after that none of them
+	// can be in the TLB and nothing below needs invalidating.
+	if (rcr3() == e->env_cr3)
+		lcr3(boot_cr3);
+
+	env_free_tables(e, &pdx, ~0);
+	env_free_finish(e);
+}
+
+//
+// Kills env e.  And schedules a new env
 // if e was the current env.
 //
+// e stops running, and envid2env() stops finding it, at once, but its
+// memory is freed later, a few page tables at a time, by env_reap().
+// Its slot is not reused, and so its envid not made stale, until then.
+//
 void
 env_destroy(struct Env *e) 
 {
-	env_free(e);
+	printf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
+	e->env_status = ENV_DYING;
+	LIST_INSERT_HEAD(&env_zombie_list, e, env_link);
 
 	if (curenv == e) {
 		curenv = NULL;
@@ -444,6 +563,41 @@ env_destroy(struct Env *e)
 	}
 }
 
+//
+// Free up to n page tables' worth of destroyed environments, finishing
+// each before starting on the next.  Called from the clock interrupt,
+// the idle path, and page_alloc() when memory runs out.  Returns how
+// many tables were freed, or 0 if there was nothing to free.
+//
+u_int
+env_reap(u_int n)
+{
+	struct Env *e;
+	u_int left = n;
+
+	while (left > 0) {
+		if ((e = env_reaping) == 0) {
+			if ((e = LIST_FIRST(&env_zombie_list)) == 0)
+				break;
+			LIST_REMOVE(e, env_link);
+			env_reaping = e;
+			env_reap_pdx = 0;
+		}
+
+		// the idle path may still be running on e's page directory
+		if (rcr3() == e->env_cr3)
+			lcr3(boot_cr3);
+
+		left -= env_free_tables(e, &env_reap_pdx, left);
+		if (env_reap_pdx < PDX(UTOP))
+			break;
+		env_free_finish(e);
+		env_reaping = 0;
+		if (left > 0)
+			left--;	// the page directory counts as a table
+	}
+	return n - left;
+}
 
 //
 // Restores the register values in the Trapframe
@@ -475,11 +629,8 @@ void
 env_run(struct Env *e)
 {
 	// save the register state of the previously executing environment
-	if (curenv) {
-		// Your code here.
-		// Hint: this can be done in a single line of code.
-		panic("need to save previous env's register state!");
-	}
+	if (curenv)
+		curenv->env_tf = *UTF;
 
 	// step 1: set curenv to the new environment to be run.
 	// step 2: use lcr3 to switch to the new environment's address space.
@@ -488,9 +639,9 @@ env_run(struct Env *e)
 	
 	curenv = e;
 
-	printf("env_run(env_run(env_run(env_run(env_run(env_run(env_run(env_run:%x\n", e->env_cr3);
-	lcr3(e->env_cr3);
-	printf("env_run(env_run(env_run(env_run(env_run(env_run(env_run(env_run(\n");
+	// Rerunning the same environment needs no TLB flush at all.
+	if (rcr3() != e->env_cr3)
+		lcr3(e->env_cr3);
 	env_pop_tf(&e->env_tf);
 }
 
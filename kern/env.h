@@ -8,12 +8,26 @@
 LIST_HEAD(Env_list, Env);
 extern struct Env *envs;		// All environments
 extern struct Env *curenv;	        // the current env
+extern u_int nenv;			// number of entries in envs
+
+// Physical pages budgeted per environment when sizing envs: every
+// env needs at least a page directory, a stack page table and a stack.
+#define ENV_NPAGES	3
+
+// Page tables env_reap() frees of destroyed environments per clock
+// tick, per pass through the idle path, and per page_alloc() that
+// finds no free page.
+#define ENV_REAP_TICK	4
+#define ENV_REAP_IDLE	32
+#define ENV_REAP_ALLOC	32
 
 void env_init(void);
 int env_alloc(struct Env **e, u_int parent_id);
 void env_free(struct Env *);
 void env_create(u_char *binary, int size);
+int env_spawn(struct Env **new, const char *name, u_int parent_id);
 void env_destroy(struct Env *e);
+u_int env_reap(u_int n);
 
 int envid2env(u_int envid, struct Env **penv, int checkperm);
 void env_run(struct Env *e);
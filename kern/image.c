@@ -0,0 +1,200 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/elf.h>
+
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/image.h>
+
+struct Image_list images;		// every cached image
+
+static struct Kmem_cache *image_cache;	// where struct Images come from
+
+//
+// Whether the page at va holds nothing but read-only segments, so
+// that it can be shared.  ph..eph are the image's program headers.
+//
+static int
+image_page_shareable(struct Proghdr *ph, struct Proghdr *eph, u_int va)
+{
+	for (; ph < eph; ph++)
+		if (ph->p_type == ELF_PROG_LOAD
+		    && (ph->p_flags & ELF_PROG_FLAG_WRITE)
+		    && ph->p_va < va + BY2PG
+		    && ROUND(ph->p_va + ph->p_memsz, BY2PG) > va)
+			return 0;
+	return 1;
+}
+
+//
+// Call fn(arg, va) for each shareable page of the image, in order.
+// The program headers must be sorted by address, as the ELF spec
+// requires.
+//
+static void
+image_walk(u_char *binary, void (*fn)(void *arg, u_int va), void *arg)
+{
+	struct Elf *elf = (struct Elf *)binary;
+	struct Proghdr *ph, *eph, *p;
+	u_int va, end, last = 0;
+	int any = 0;
+
+	ph = (struct Proghdr *)(binary + elf->e_phoff);
+	eph = ph + elf->e_phnum;
+	for (p = ph; p < eph; p++) {
+		if (p->p_type != ELF_PROG_LOAD
+		    || (p->p_flags & ELF_PROG_FLAG_WRITE))
+			continue;
+		end = ROUND(p->p_va + p->p_memsz, BY2PG);
+		for (va = ROUNDDOWN(p->p_va, BY2PG); va < end; va += BY2PG) {
+			// two segments can share a page
+			if (any && va <= last)
+				continue;
+			if (!image_page_shareable(ph, eph, va))
+				continue;
+			fn(arg, va);
+			last = va;
+			any = 1;
+		}
+	}
+}
+
+static void
+image_count(void *arg, u_int va)
+{
+	(*(u_int *)arg)++;
+}
+
+static void
+image_record(void *arg, u_int va)
+{
+	struct Image *im = arg;
+
+	im->im_pages[im->im_npages++].ip_va = va;
+}
+
+//
+// Fill kva, a page that will be mapped at va, with what the image's
+// segments put there.  The page must already be zeroed.
+//
+void
+image_fill(u_char *binary, u_int va, u_char *kva)
+{
+	struct Elf *elf = (struct Elf *)binary;
+	struct Proghdr *ph, *eph;
+	u_int start, end;
+
+	ph = (struct Proghdr *)(binary + elf->e_phoff);
+	eph = ph + elf->e_phnum;
+	for (; ph < eph; ph++) {
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		start = MAX(ph->p_va, va);
+		end = MIN(ph->p_va + ph->p_filesz, va + BY2PG);
+		if (start < end)
+			memcpy(kva + (start - va),
+				binary + ph->p_offset + (start - ph->p_va),
+				end - start);
+	}
+}
+
+static void
+image_free(struct Image *im)
+{
+	u_int i;
+
+	for (i = 0; i < im->im_npages; i++)
+		if (im->im_pages[i].ip_page)
+			page_decref(im->im_pages[i].ip_page);
+	kfree(im->im_pages);
+	kmem_cache_free(image_cache, im);
+}
+
+//
+// Find the cached image for the ELF image at binary, building it the
+// first time.  The caller must have checked that binary is a valid
+// ELF image whose segments lie below UTOP.
+//
+// RETURNS
+//   0 on success, and sets *pim
+//   -E_NO_MEM, if there is no memory
+//
+int
+image_get(u_char *binary, struct Image **pim)
+{
+	struct Image *im;
+	struct Page *pp;
+	u_int i, n;
+	void *va;
+	int r;
+
+	LIST_FOREACH(im, &images, im_link)
+		if (im->im_binary == binary) {
+			*pim = im;
+			return 0;
+		}
+
+	if (image_cache == 0) {
+		image_cache = kmem_cache_create("image",
+			sizeof(struct Image), sizeof(void *), 0);
+		if (image_cache == 0)
+			return -E_NO_MEM;
+	}
+
+	if ((im = kmem_cache_alloc(image_cache)) == 0)
+		return -E_NO_MEM;
+	memset(im, 0, sizeof(*im));
+	im->im_binary = binary;
+
+	n = 0;
+	image_walk(binary, image_count, &n);
+	if (n > 0) {
+		im->im_pages = kmalloc(n * sizeof(im->im_pages[0]));
+		if (im->im_pages == 0) {
+			kmem_cache_free(image_cache, im);
+			return -E_NO_MEM;
+		}
+		memset(im->im_pages, 0, n * sizeof(im->im_pages[0]));
+		image_walk(binary, image_record, im);
+	}
+
+	for (i = 0; i < im->im_npages; i++) {
+		if ((r = page_alloc_user_zeroed(&pp)) < 0) {
+			image_free(im);
+			return r;
+		}
+		pp->pp_ref = 1;
+		va = page_kmap(pp);
+		image_fill(binary, im->im_pages[i].ip_va, va);
+		page_kunmap(va);
+		im->im_pages[i].ip_page = pp;
+	}
+
+	LIST_INSERT_HEAD(&images, im, im_link);
+	*pim = im;
+	return 0;
+}
+
+//
+// Map the shared pages of im read-only into pgdir.
+//
+// RETURNS
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated
+//
+int
+image_map(struct Image *im, Pde *pgdir)
+{
+	u_int i;
+	int r;
+
+	for (i = 0; i < im->im_npages; i++)
+		if ((r = page_insert(pgdir, im->im_pages[i].ip_page,
+				im->im_pages[i].ip_va, PTE_U)) < 0)
+			return r;
+	im->im_nloads++;
+	return 0;
+}
@@ -0,0 +1,43 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef _KERN_IMAGE_H_
+#define _KERN_IMAGE_H_
+
+#include <inc/types.h>
+#include <inc/queue.h>
+#include <inc/pmap.h>
+
+//
+// Cache of the read-only pages of the user program images linked
+// into the kernel.
+//
+// The first environment loaded from an image fills in the pages that
+// only read-only ELF segments cover (text and rodata).  Every
+// environment loaded from it afterwards maps those same physical
+// pages instead of copying them; pages with any writable data stay
+// private.  The cache holds one reference on each page, and each
+// mapping another, so the pages live as long as the kernel.
+//
+
+LIST_HEAD(Image_list, Image);
+
+struct Image_page {
+	u_int ip_va;			// user virtual address of the page
+	struct Page *ip_page;
+};
+
+struct Image {
+	u_char *im_binary;		// the ELF image; the cache key
+	u_int im_npages;		// number of shared pages
+	struct Image_page *im_pages;	// sorted by ip_va
+	u_int im_nloads;		// environments loaded from it
+	LIST_ENTRY(Image) im_link;	// link on images
+};
+
+extern struct Image_list images;
+
+int  image_get(u_char *binary, struct Image **);
+int  image_map(struct Image *, Pde *pgdir);
+void image_fill(u_char *binary, u_int va, u_char *kva);
+
+#endif /* !_KERN_IMAGE_H_ */
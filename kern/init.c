@@ -9,22 +9,26 @@
 #include <kern/console.h>
 #include <kern/pmap.h>
 #include <kern/kclock.h>
+#include <kern/kmalloc.h>
 #include <kern/env.h>
 #include <kern/trap.h>
 #include <kern/sched.h>
 #include <kern/picirq.h>
 
 #include <kern/keyboard.h>
+#include <kern/swap.h>
+#include <kern/rmap.h>
+#include <kern/ksm.h>
 
 #include <inc/elf.h>
 
 
-u_int elf_hdr   = 0xf0007E00;     // elf header
-u_int sh_addr   = 0xf01E0000;     // section header
-u_int sym_table = 0xf01C0000;     // symbol section
-u_int str_table = 0xf01A0000;     // string section
+u_int elf_hdr   = 0xf0007E00;     // elf header, left by the boot loader
+u_int sh_addr;                    // section header
+u_int sym_table;                  // symbol section
+u_int str_table;                  // string section
 
-u_int sym_entry_count = -1;
+u_int sym_entry_count = 0;
 
 
 void
@@ -53,41 +57,35 @@ load_tables(void)
 	u_int sh_entsize = elf->e_shentsize;
 	u_int i;
 
+	// The tables go right after the kernel's bss, in memory
+	// alloc() hands out, so they move with the kernel as it grows
+	// instead of sitting at fixed addresses it could grow over.
+	sh_addr = (u_int)alloc(sh_num * sh_entsize, 4, 0);
 	readseg_kern(sh_addr, sh_num * sh_entsize, sh_off);
 
-	// rectify the address
-	//sh_addr += (sh_off & 511);
-
 	printf("section header sh off=%x, shaddr=%x, sh_num=%d sh_entsize=%d\n", sh_off, sh_addr, sh_num, sh_entsize);
 
 	
 	Elf32_Hsdr *sh = (Elf32_Hsdr*) sh_addr;
 
-	int sym_table1 = sym_table;
-	int str_table1 = str_table;
-
-	for(i = 0; i < sh_num; i++, sh++)
+	for(i = 0; i < sh_num; i++)
 	{
-		if(sh->sh_type == SHT_SYMTAB)
+		if(sh[i].sh_type == SHT_SYMTAB && sh[i].sh_link < sh_num)
 		{
-		    readseg_kern(sym_table1, sh->sh_size, sh->sh_offset);
-		    printf("sym table offset:%x\n", sh->sh_offset);
+		    Elf32_Hsdr *strsh = &sh[sh[i].sh_link];
+
+		    sym_table = (u_int)alloc(sh[i].sh_size, 4, 0);
+		    readseg_kern(sym_table, sh[i].sh_size, sh[i].sh_offset);
+		    printf("sym table offset:%x\n", sh[i].sh_offset);
 
-		    //rectify the address
-		    sym_table1 += sh->sh_offset ;
-		    //sym_table += (sh->sh_offset & 511);
+		    // the symbol names are in the string table it links to
+		    str_table = (u_int)alloc(strsh->sh_size, 4, 0);
+		    readseg_kern(str_table, strsh->sh_size, strsh->sh_offset);
+		    printf("str table offset:%x\n", strsh->sh_offset);
 
 		    // get the size
-		    sym_entry_count = sh->sh_size >> 4; // size/16
-		}
-		else if(sh->sh_type == SHT_STRTAB && i != elf->e_shstrndx)
-		{
-		    readseg_kern(str_table1, sh->sh_size, sh->sh_offset);
-		    printf("str table offset:%x\n", sh->sh_offset);
-		    
-		    //rectify the address
-		    //str_table += (sh->sh_offset & 511);
-		    str_table1 += sh->sh_offset;
+		    sym_entry_count = sh[i].sh_size >> 4; // size/16
+		    break;
 		}
 	}
 
@@ -118,29 +116,6 @@ find_symbol(u_int address)
     	return result;
 }
 
-void detect_mem()
-{
-
-char hi, low;
-
-outb(0x34, 0x70);
-low = inb(0x71);
-
-outb(0x35, 0x70);
-hi = inb(0x71);
-
-int val = 0;
-val += (hi & 0xFF);
-val <<= 8;
-
-val += (low & 0xFF);
-
-printf("total mem=%x\n", val);
-val <<= 16;
-
-printf("total mem=%x\n", val);
-}
-
 void
 i386_init(void)
 {
@@ -177,10 +152,14 @@ i386_init(void)
 	i386_vm_init();
 	page_init();
 	page_check();
+	kmalloc_init();
+	rmap_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
 	idt_init();
+	swap_init();
+	ksm_init();
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
@@ -194,41 +173,14 @@ i386_init(void)
 	ENV_CREATE2(TEST, TESTSIZE)
 #else
 	// Touch all you want.
-	ENV_CREATE(user_primes);
-#endif // TEST*
-
-	// detect_mem(); ?????????????????????
-	// Lab 2 memory management initialization functions
-	i386_detect_memory();
-
-	printf("4\n");
-	i386_vm_init();
-	printf("5\n");
-	page_init();
-	printf("6\n");
-	page_check();
-
-	printf("7\n");
-	// Lab 3 user environment initialization functions
-	env_init();
-	idt_init();
-
-
-	// Temporary test code specific to LAB 3
-#if defined(TEST)
-	// Don't touch -- used by grading script!
-	ENV_CREATE2(TEST, TESTSIZE);
-#else
-	// Touch all you want.
-	//ENV_CREATE(user_faultread);
-	//ENV_CREATE(user_evilhello);
+	ENV_CREATE(user_forktree);
 #endif // TEST*
 
 	// Schedule and run the first user environment!
 	sched_yield();
 
 	// We only have one user environment for now, so just run it.
-	env_run(&envs[NENV-1]);
+	env_run(&envs[nenv-1]);
 
 	// Drop into the kernel monitor.
 	while (1)
@@ -0,0 +1,319 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+
+struct Kmem_cache_list kmem_caches;	// every cache, for the monitor
+
+// The cache that Kmem_cache structures themselves come from.
+static struct Kmem_cache cache_cache;
+
+// Power-of-two size classes behind kmalloc(), 16 .. KMALLOC_MAX bytes.
+#define KMALLOC_MINSHIFT	4
+#define KMALLOC_NCLASSES	7
+static struct Kmem_cache *kmalloc_caches[KMALLOC_NCLASSES];
+static const char *kmalloc_names[KMALLOC_NCLASSES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024"
+};
+
+static void kmalloc_check(void);
+
+//
+// Fill in the geometry of cache c.
+// align must be a power of two; objects are at least one pointer
+// big, since free objects hold the free list link.
+//
+static void
+cache_setup(struct Kmem_cache *c, const char *name, u_int size,
+	u_int align, void (*ctor)(void *))
+{
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+
+	memset(c, 0, sizeof(*c));
+	c->kc_name = name;
+	c->kc_align = align;
+	c->kc_size = ROUND(size, align);
+	c->kc_first = ROUND(sizeof(struct Slab), align);
+	c->kc_perslab = (BY2PG - c->kc_first) / c->kc_size;
+	c->kc_ctor = ctor;
+	LIST_INIT(&c->kc_partial);
+	LIST_INIT(&c->kc_full);
+
+	if (c->kc_perslab == 0)
+		panic("kmem cache %s: %d-byte objects do not fit in a slab",
+			name, size);
+
+	LIST_INSERT_HEAD(&kmem_caches, c, kc_link);
+}
+
+//
+// Allocate a page for a new slab of cache c and thread all of its
+// objects onto the slab's free list.
+// Returns 0 if there is no memory.
+//
+static struct Slab *
+slab_create(struct Kmem_cache *c)
+{
+	struct Page *pp;
+	struct Slab *sl;
+	char *obj;
+	int i;
+
+	if (page_alloc(&pp) < 0)
+		return 0;
+	pp->pp_ref = 1;
+
+	sl = (struct Slab *)page2kva(pp);
+	sl->sl_cache = c;
+	sl->sl_inuse = 0;
+	sl->sl_free = 0;
+
+	// link the objects so the lowest address is handed out first
+	for (i = c->kc_perslab - 1; i >= 0; i--) {
+		obj = (char *)sl + c->kc_first + i * c->kc_size;
+		*(void **)obj = sl->sl_free;
+		sl->sl_free = obj;
+	}
+
+	c->kc_nslabs++;
+	return sl;
+}
+
+static void
+slab_destroy(struct Kmem_cache *c, struct Slab *sl)
+{
+	struct Page *pp = pa2page(PADDR(sl));
+
+	assert(sl->sl_inuse == 0);
+	c->kc_nslabs--;
+	pp->pp_ref = 0;
+	page_free(pp);
+}
+
+//
+// Create a cache of size-byte objects aligned on align bytes.
+// If ctor is non-null it is run on every object handed out.
+// Returns 0 if there is no memory for the cache descriptor.
+//
+struct Kmem_cache *
+kmem_cache_create(const char *name, u_int size, u_int align,
+	void (*ctor)(void *))
+{
+	struct Kmem_cache *c;
+
+	if ((c = kmem_cache_alloc(&cache_cache)) == 0)
+		return 0;
+	cache_setup(c, name, size, align, ctor);
+	return c;
+}
+
+//
+// Destroy cache c, which must have no objects allocated.
+//
+void
+kmem_cache_destroy(struct Kmem_cache *c)
+{
+	assert(c->kc_inuse == 0);
+	if (c->kc_empty)
+		slab_destroy(c, c->kc_empty);
+	LIST_REMOVE(c, kc_link);
+	kmem_cache_free(&cache_cache, c);
+}
+
+//
+// Allocate an object from cache c.
+// Returns 0 if there is no memory.
+//
+void *
+kmem_cache_alloc(struct Kmem_cache *c)
+{
+	struct Slab *sl;
+	void *obj;
+
+	if ((sl = LIST_FIRST(&c->kc_partial)) == 0) {
+		if ((sl = c->kc_empty) != 0)
+			c->kc_empty = 0;
+		else if ((sl = slab_create(c)) == 0)
+			return 0;
+		LIST_INSERT_HEAD(&c->kc_partial, sl, sl_link);
+	}
+
+	obj = sl->sl_free;
+	sl->sl_free = *(void **)obj;
+	if (++sl->sl_inuse == c->kc_perslab) {
+		LIST_REMOVE(sl, sl_link);
+		LIST_INSERT_HEAD(&c->kc_full, sl, sl_link);
+	}
+
+	c->kc_inuse++;
+	c->kc_nalloc++;
+	if (c->kc_ctor)
+		c->kc_ctor(obj);
+	return obj;
+}
+
+//
+// Return obj to cache c.  A slab that becomes completely free is kept
+// as the cache's spare, or handed back to the page allocator if the
+// cache already has one.
+//
+void
+kmem_cache_free(struct Kmem_cache *c, void *obj)
+{
+	struct Slab *sl = (struct Slab *)ROUNDDOWN(obj, BY2PG);
+	int wasfull;
+
+	assert(sl->sl_cache == c && sl->sl_inuse > 0);
+
+	wasfull = (sl->sl_inuse == c->kc_perslab);
+	*(void **)obj = sl->sl_free;
+	sl->sl_free = obj;
+	c->kc_inuse--;
+	c->kc_nfree++;
+
+	if (--sl->sl_inuse == 0) {
+		LIST_REMOVE(sl, sl_link);
+		if (c->kc_empty == 0)
+			c->kc_empty = sl;
+		else
+			slab_destroy(c, sl);
+	} else if (wasfull) {
+		LIST_REMOVE(sl, sl_link);
+		LIST_INSERT_HEAD(&c->kc_partial, sl, sl_link);
+	}
+}
+
+//
+// General-purpose allocation of size bytes.
+// Small requests come from the power-of-two caches, and are aligned
+// on their size class (up to 32 bytes); bigger ones get whole,
+// page-aligned buddy blocks.
+// Returns 0 if there is no memory.
+//
+void *
+kmalloc(u_int size)
+{
+	struct Page *pp;
+	int i, order;
+
+	if (size == 0)
+		return 0;
+
+	if (size > KMALLOC_MAX) {
+		for (order = 0; (BY2PG << order) < size; order++)
+			;
+		if (page_alloc_order(order, &pp) < 0)
+			return 0;
+		pp->pp_ref = 1;
+		return (void *)page2kva(pp);
+	}
+
+	for (i = 0; (1 << (i + KMALLOC_MINSHIFT)) < size; i++)
+		;
+	return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+//
+// Free memory returned by kmalloc.
+// Slab objects never start on a page boundary (the slab header is
+// there), so page-aligned pointers are buddy blocks.
+//
+void
+kfree(void *v)
+{
+	struct Page *pp;
+	struct Slab *sl;
+
+	if (v == 0)
+		return;
+
+	if (PGOFF(v) == 0) {
+		pp = pa2page(PADDR(v));
+		pp->pp_ref = 0;
+		page_free_order(pp, pp->pp_order);
+		return;
+	}
+
+	sl = (struct Slab *)ROUNDDOWN(v, BY2PG);
+	kmem_cache_free(sl->sl_cache, v);
+}
+
+//
+// Set up the cache of caches and the kmalloc size classes.
+// Must be called after page_init().
+//
+void
+kmalloc_init(void)
+{
+	int i;
+	u_int size;
+
+	LIST_INIT(&kmem_caches);
+	cache_setup(&cache_cache, "kmem_cache",
+		sizeof(struct Kmem_cache), sizeof(void *), 0);
+
+	for (i = 0; i < KMALLOC_NCLASSES; i++) {
+		size = 1 << (i + KMALLOC_MINSHIFT);
+		kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i],
+			size, MIN(size, 32), 0);
+		if (kmalloc_caches[i] == 0)
+			panic("kmalloc_init: out of memory");
+	}
+
+	kmalloc_check();
+}
+
+static int kmalloc_check_ctor_runs;
+
+static void
+kmalloc_check_ctor(void *obj)
+{
+	memset(obj, 0x5a, 24);
+	kmalloc_check_ctor_runs++;
+}
+
+static void
+kmalloc_check(void)
+{
+	struct Kmem_cache *c;
+	char *a, *b, *p;
+
+	// small objects come from a slab and are aligned on their class
+	a = kmalloc(10);
+	b = kmalloc(10);
+	assert(a && b && a != b);
+	assert(((u_long)a & 15) == 0 && ((u_long)b & 15) == 0);
+	assert(PGOFF(a) != 0);
+
+	// large objects are whole pages
+	p = kmalloc(3 * BY2PG);
+	assert(p && PGOFF(p) == 0);
+	assert(pa2page(PADDR(p))->pp_order == 2);
+
+	// freed objects are reused first
+	kfree(b);
+	kfree(a);
+	kfree(p);
+	assert(kmalloc(16) == a);
+	kfree(a);
+
+	// constructors run on allocation
+	c = kmem_cache_create("kmalloc_check", 24, 8, kmalloc_check_ctor);
+	assert(c && c->kc_size == 24);
+	a = kmem_cache_alloc(c);
+	assert(a && kmalloc_check_ctor_runs == 1 && a[23] == 0x5a);
+	assert(c->kc_inuse == 1 && c->kc_nslabs == 1);
+	kmem_cache_free(c, a);
+	assert(c->kc_inuse == 0);
+	kmem_cache_destroy(c);
+
+	printf("kmalloc_check() succeeded!\n");
+}
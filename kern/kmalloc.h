@@ -0,0 +1,65 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef _KERN_KMALLOC_H_
+#define _KERN_KMALLOC_H_
+
+#include <inc/types.h>
+#include <inc/queue.h>
+
+//
+// Slab allocator for kernel objects smaller than a page.
+//
+// Each cache hands out objects of one size.  Objects are carved out of
+// single-page slabs; the struct Slab header lives at the start of its
+// page and free objects are chained through their first word.
+//
+
+LIST_HEAD(Slab_list, Slab);
+LIST_HEAD(Kmem_cache_list, Kmem_cache);
+
+struct Slab {
+	LIST_ENTRY(Slab) sl_link;	// link on one of the cache's lists
+	struct Kmem_cache *sl_cache;	// cache this slab belongs to
+	void *sl_free;			// first free object in the slab
+	u_int sl_inuse;			// number of allocated objects
+};
+
+struct Kmem_cache {
+	const char *kc_name;
+	u_int kc_size;			// object size, rounded up to kc_align
+	u_int kc_align;
+	u_int kc_first;			// offset of first object in a slab
+	u_int kc_perslab;		// objects per slab
+	void (*kc_ctor)(void *);	// run on each object as it is allocated
+
+	struct Slab_list kc_partial;	// slabs with some free objects
+	struct Slab_list kc_full;	// slabs with no free objects
+	struct Slab *kc_empty;		// one fully free slab kept around
+
+	// usage statistics
+	u_int kc_nslabs;
+	u_int kc_inuse;
+	u_int kc_nalloc;
+	u_int kc_nfree;
+
+	LIST_ENTRY(Kmem_cache) kc_link;	// link on kmem_caches
+};
+
+extern struct Kmem_cache_list kmem_caches;
+
+// Requests bigger than this bypass the slab caches and go straight to
+// the buddy allocator.
+#define KMALLOC_MAX	1024
+
+void kmalloc_init(void);
+
+struct Kmem_cache *kmem_cache_create(const char *name, u_int size,
+		u_int align, void (*ctor)(void *));
+void kmem_cache_destroy(struct Kmem_cache *);
+void *kmem_cache_alloc(struct Kmem_cache *);
+void kmem_cache_free(struct Kmem_cache *, void *);
+
+void *kmalloc(u_int size);
+void kfree(void *);
+
+#endif /* !_KERN_KMALLOC_H_ */
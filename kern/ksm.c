@@ -0,0 +1,261 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kmalloc.h>
+#include <kern/rmap.h>
+#include <kern/ksm.h>
+
+// A merged page, or a candidate for merging.
+struct Ksm_node {
+	u_int kn_hash;			// ksm_hash() of the contents
+	int kn_stable;			// merged, and referenced by us
+	struct Page *kn_page;
+	LIST_ENTRY(Ksm_node) kn_link;	// link on its hash chain
+};
+
+LIST_HEAD(Ksm_list, Ksm_node);
+
+#define KSM_NHASH	256		// hash chains
+
+static struct Kmem_cache *ksm_cache;	// where struct Ksm_nodes come from
+static struct Ksm_list ksm_hash_chains[KSM_NHASH];
+static struct Ksm_stats stats;
+
+// The scan cursor: the next PTE ksm_scan() looks at.
+static struct Pte_hand hand;
+
+void
+ksm_init(void)
+{
+	ksm_cache = kmem_cache_create("ksm", sizeof(struct Ksm_node),
+		sizeof(void *), 0);
+	if (ksm_cache == 0)
+		panic("ksm_init: out of memory");
+}
+
+// FNV-1a, a word at a time.
+static u_int
+ksm_hash(const u_int *p)
+{
+	u_int h = 2166136261U;
+	int i;
+
+	for (i = 0; i < BY2PG / sizeof(u_int); i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h;
+}
+
+//
+// Whether pp has been written through any of its mappings since the
+// last look.  Clears the dirty bits for the next one.
+//
+static int
+page_dirtied(struct Page *pp)
+{
+	struct Rmap *rm;
+	Pte *pte;
+	int r = 0;
+
+	RMAP_FOREACH(rm, pp) {
+		pte = rmap_pte(rm);
+		if (*pte & PTE_D) {
+			*pte &= ~PTE_D;
+			tlb_invalidate_pte(rm->rm_pgdir, pte, rm->rm_va);
+			pp->pp_flags |= PG_WS_D;
+			r = 1;
+		}
+	}
+	if (pp->pp_flags & PG_KSM_D) {
+		pp->pp_flags &= ~PG_KSM_D;
+		r = 1;
+	}
+	return r;
+}
+
+//
+// Make pp, which is about to be shared, copy-on-write in every
+// mapping that can write it.
+//
+static void
+page_protect(struct Page *pp)
+{
+	struct Rmap *rm;
+	Pte *pte;
+
+	RMAP_FOREACH(rm, pp) {
+		pte = rmap_pte(rm);
+		if (*pte & PTE_W) {
+			*pte = (*pte & ~PTE_W) | PTE_COW;
+			tlb_invalidate_pte(rm->rm_pgdir, pte, rm->rm_va);
+		}
+	}
+}
+
+//
+// Point every mapping of pp at kp, whose contents are the same,
+// copy-on-write if it could write pp.  pp goes with its last mapping.
+// Like page_protect(), this rewrites each PTE where it is: nothing is
+// allocated, so it cannot fail partway, and a page table shared
+// since fork stays shared.
+//
+static void
+page_merge(struct Page *pp, struct Page *kp)
+{
+	struct Rmap *rm;
+	u_int perm;
+	Pte *pte;
+
+	// hold pp until the last record has moved
+	pp->pp_ref++;
+	while ((rm = pp->pp_rmap) != 0) {
+		pte = rmap_pte(rm);
+		perm = (u_int)*pte & PTE_USER;
+		if (perm & PTE_W)
+			perm = (perm & ~PTE_W) | PTE_COW;
+		*pte = page2pte(kp) | perm;
+		tlb_invalidate_pte(rm->rm_pgdir, pte, rm->rm_va);
+		rmap_move(pp, kp, rm);
+		kp->pp_ref++;
+		pp->pp_ref--;
+		stats.ks_merged++;
+	}
+	page_decref(pp);
+}
+
+static void
+node_free(struct Ksm_node *kn)
+{
+	LIST_REMOVE(kn, kn_link);
+	if (kn->kn_stable) {
+		stats.ks_stable--;
+		page_decref(kn->kn_page);
+	} else
+		stats.ks_unstable--;
+	kmem_cache_free(ksm_cache, kn);
+}
+
+//
+// At the end of a lap, forget this lap's candidates, and let go of
+// the merged pages that nothing maps any more.
+//
+static void
+ksm_lap(void)
+{
+	struct Ksm_node *kn, *next;
+	int i;
+
+	for (i = 0; i < KSM_NHASH; i++)
+		for (kn = LIST_FIRST(&ksm_hash_chains[i]); kn; kn = next) {
+			next = LIST_NEXT(kn, kn_link);
+			if (!kn->kn_stable || kn->kn_page->pp_ref == 1)
+				node_free(kn);
+		}
+	stats.ks_laps++;
+}
+
+//
+// Whether pages a and b hold the same bytes.
+//
+static int
+page_same(struct Page *a, struct Page *b)
+{
+	void *va = page_kmap(a), *vb = page_kmap(b);
+	int r;
+
+	r = memcmp(va, vb, BY2PG) == 0;
+	page_kunmap(vb);
+	page_kunmap(va);
+	return r;
+}
+
+//
+// Look for a twin of pp, which has not changed since the last lap,
+// and merge the two if there is one.  Otherwise remember pp as a
+// candidate for later pages to match.
+//
+static void
+ksm_page(struct Page *pp)
+{
+	struct Ksm_node *kn;
+	struct Ksm_list *chain;
+	u_int hash;
+	void *va;
+
+	va = page_kmap(pp);
+	hash = ksm_hash(va);
+	page_kunmap(va);
+	stats.ks_scanned++;
+	chain = &ksm_hash_chains[hash % KSM_NHASH];
+
+	LIST_FOREACH(kn, chain, kn_link) {
+		if (kn->kn_hash != hash || kn->kn_page == pp)
+			continue;
+		// A candidate's page may have changed hands since; it
+		// still does if it holds the same bytes and can move.
+		if (!page_same(kn->kn_page, pp)
+		    || (!kn->kn_stable && !rmap_movable(kn->kn_page)))
+			continue;
+
+		if (!kn->kn_stable) {
+			page_protect(kn->kn_page);
+			kn->kn_page->pp_ref++;
+			kn->kn_stable = 1;
+			stats.ks_unstable--;
+			stats.ks_stable++;
+		}
+		page_merge(pp, kn->kn_page);
+		return;
+	}
+
+	if ((kn = kmem_cache_alloc(ksm_cache)) == 0)
+		return;
+	kn->kn_hash = hash;
+	kn->kn_stable = 0;
+	kn->kn_page = pp;
+	LIST_INSERT_HEAD(chain, kn, kn_link);
+	stats.ks_unstable++;
+}
+
+//
+// Look at the next n user PTEs, merging their pages where possible.
+// Called from the idle path.
+//
+void
+ksm_scan(u_int n)
+{
+	struct Page *pp;
+	Pte *pte;
+	u_long va;
+
+	while (n-- > 0) {
+		switch (pte_hand_step(&hand, &pte, &va)) {
+		case PH_LAP:
+			ksm_lap();
+			break;
+		case PH_PTE:
+			pp = pte2page(*pte);
+			if (rmap_movable(pp) && !page_dirtied(pp))
+				ksm_page(pp);
+			break;
+		}
+	}
+}
+
+void
+ksm_stats(struct Ksm_stats *ks)
+{
+	struct Ksm_node *kn;
+	int i;
+
+	*ks = stats;
+	ks->ks_mappings = 0;
+	for (i = 0; i < KSM_NHASH; i++)
+		LIST_FOREACH(kn, &ksm_hash_chains[i], kn_link)
+			if (kn->kn_stable)
+				ks->ks_mappings += rmap_count(kn->kn_page);
+}
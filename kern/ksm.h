@@ -0,0 +1,44 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef _KERN_KSM_H_
+#define _KERN_KSM_H_
+
+#include <inc/types.h>
+
+//
+// Same-page merging: the idle path scans user pages and makes all
+// the mappings of byte-identical ones share one copy-on-write page.
+//
+// The scan walks the environments' user PTEs with a cursor of its
+// own.  Pages written since the previous lap (PTE_D set in some
+// mapping) are skipped as too volatile, and only pages that
+// rmap_movable() allows are considered.  Each candidate is hashed
+// and looked up among the merged ("stable") pages and then among
+// this lap's other candidates ("unstable"); a match that compares
+// equal becomes, or already is, a stable page, write-protected with
+// PTE_COW in every mapping, and the candidate's mappings are moved
+// onto it.  A write to it splits a private copy off through
+// page_cow_fault().
+//
+// The scanner holds a reference to each stable page, which also
+// keeps swap_out() away from them.  The reference is dropped once
+// it is the last one.
+//
+
+struct Ksm_stats {
+	u_int ks_stable;		// merged pages
+	u_int ks_mappings;		// user mappings of them
+	u_int ks_unstable;		// candidates waiting for a twin
+	u_long ks_scanned;		// pages hashed
+	u_long ks_merged;		// mappings moved onto a merged page
+	u_long ks_laps;			// full passes over all the envs
+};
+
+// PTEs the idle path looks at per call.
+#define KSM_BATCH	256
+
+void ksm_init(void);
+void ksm_scan(u_int n);
+void ksm_stats(struct Ksm_stats *);
+
+#endif /* !_KERN_KSM_H_ */
@@ -12,6 +12,14 @@
 #include <kern/trap.h>
 
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/env.h>
+#include <kern/sched.h>
+#include <kern/image.h>
+#include <kern/swap.h>
+#include <kern/rmap.h>
+#include <kern/ksm.h>
+#include <kern/ws.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -27,6 +35,16 @@ static struct Command commands[] = {
 	{"alloc_page",	"Allocate a physical page", mon_alloc_page},
 	{"page_status",	"Show status of a page at the physical address", mon_page_status},
 	{"free_page",	"Free a page at the pysical address", mon_free_page},
+	{"buddyinfo",	"Show free physical memory by block order", mon_buddyinfo},
+	{"kmeminfo",	"Show kernel object cache usage", mon_kmeminfo},
+	{"ptinfo",	"Show memory used by page tables", mon_ptinfo},
+	{"imageinfo",	"Show pages shared between envs loaded from one binary", mon_imageinfo},
+	{"envstress",	"Create, look up and schedule [n] environments", mon_envstress},
+	{"swapinfo",	"Show swap space use and paging rates", mon_swapinfo},
+	{"pagemap",	"Show the envs and addresses mapping a physical page", mon_pagemap},
+	{"ksminfo",	"Show user pages merged by the idle scanner", mon_ksminfo},
+	{"wsinfo",	"List environments by working set, largest [n] first", mon_wsinfo},
+	{"rmapbench",	"Time [n] page_insert/page_remove pairs and their rmap work", mon_rmapbench},
 	{"halt",	"Halt the processor", mon_halt}
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
@@ -111,6 +129,321 @@ mon_free_page(int argc, char **argv)
 
 }
 
+void
+mon_buddyinfo(int argc, char **argv)
+{
+	u_long nblocks[PAGE_MAXORDER + 1];
+	u_long nfree, nbig;
+	int o;
+
+	nfree = page_free_stats(nblocks);
+	for (o = 0; o <= PAGE_MAXORDER; o++)
+		printf("  order %2d (%4dK): %d free\n", o, (BY2PG << o) / 1024,
+			nblocks[o]);
+
+	// Fragmentation: the share of free memory that is not available
+	// as maximum-order blocks.
+	nbig = nblocks[PAGE_MAXORDER] << PAGE_MAXORDER;
+	printf("  %d pages free, %d%% fragmented\n", nfree,
+		nfree ? (int)((nfree - nbig) * 100 / nfree) : 0);
+	printf("  %d pre-zeroed pages pooled\n", page_zero_pooled());
+}
+
+void
+mon_kmeminfo(int argc, char **argv)
+{
+	struct Kmem_cache *c;
+
+	LIST_FOREACH(c, &kmem_caches, kc_link)
+		printf("  %s: %d-byte objects, %d/%d in use, %d slabs, "
+			"%d allocs, %d frees\n", c->kc_name, c->kc_size,
+			c->kc_inuse, c->kc_nslabs * c->kc_perslab,
+			c->kc_nslabs, c->kc_nalloc, c->kc_nfree);
+}
+
+void
+mon_ptinfo(int argc, char **argv)
+{
+	u_long nboot, nalloced, nshared, ncopied;
+
+	page_table_stats(&nboot, &nalloced, &nshared, &ncopied);
+	printf("  %d boot page tables (%dK), %d allocated since (%dK)\n",
+		nboot, nboot * BY2PG / 1024, nalloced, nalloced * BY2PG / 1024);
+	printf("  %d shared at fork, %d of them copied since\n",
+		nshared, ncopied);
+}
+
+void
+mon_imageinfo(int argc, char **argv)
+{
+	struct Image *im;
+	u_int i, nmap;
+
+	LIST_FOREACH(im, &images, im_link) {
+		// every reference but the cache's own is a mapping
+		nmap = 0;
+		for (i = 0; i < im->im_npages; i++)
+			nmap += im->im_pages[i].ip_page->pp_ref - 1;
+		printf("  image %08x: %d shared pages, %d loads, "
+			"%d mappings, %d pages saved\n", im->im_binary,
+			im->im_npages, im->im_nloads, nmap,
+			nmap > im->im_npages ? nmap - im->im_npages : 0);
+	}
+}
+
+// Average cycles for one envid2env() lookup of envid.
+static u_int
+envid2env_cycles(u_int envid)
+{
+	struct Env *e;
+	u_int64_t t0;
+	int i;
+
+	t0 = read_tsc();
+	for (i = 0; i < 1000; i++)
+		if (envid2env(envid, &e, 0) < 0)
+			panic("envid2env(%08x) failed", envid);
+	return (u_int)(read_tsc() - t0) / 1000;
+}
+
+void
+mon_envstress(int argc, char **argv)
+{
+	struct Env **ev, *e, *first;
+	u_int n, made, npick, i;
+	u_int64_t t0;
+
+	n = argc > 1 ? strtol(argv[1], 0, 10) : 16384;
+	n = MIN(n, nenv - 1);
+	if ((ev = kmalloc(n * sizeof(ev[0]))) == 0) {
+		printf("envstress: out of memory\n");
+		return;
+	}
+
+	for (made = 0; made < n; made++)
+		if (env_alloc(&ev[made], 0) < 0)
+			break;
+	printf("  created %d of %d envs (table holds %d)\n", made, n, nenv);
+
+	if (made > 0) {
+		// Lookups index the table directly, so the first and the
+		// last env cost the same.
+		printf("  envid2env: %d cycles for the first env, "
+			"%d for the last\n", envid2env_cycles(ev[0]->env_id),
+			envid2env_cycles(ev[made - 1]->env_id));
+
+		// One full round-robin pass must reach every runnable env.
+		t0 = read_tsc();
+		first = e = sched_next(0);
+		npick = 0;
+		do {
+			npick++;
+			e = sched_next(e);
+		} while (e != first && npick <= nenv);
+		printf("  sched_next: %d envs in one pass, %d cycles each\n",
+			npick, (u_int)(read_tsc() - t0) / npick);
+		assert(npick >= made && npick <= nenv);
+	}
+
+	while (made > 0)
+		env_free(ev[--made]);
+	kfree(ev);
+
+	// Reuse one slot for more than a full cycle of generations:
+	// envids must stay positive, keep their index, and never be 0.
+	for (i = 0; i <= ENV_NGEN; i++) {
+		if (env_alloc(&e, 0) < 0)
+			break;
+		assert((int)e->env_id > 0 && ENVX(e->env_id) == e - envs);
+		env_free(e);
+	}
+	printf("  %d envids from reused slots, all positive\n", i);
+}
+
+void
+mon_swapinfo(int argc, char **argv)
+{
+	// the counts at the previous look, for the rates
+	static struct Swap_stats last;
+	static u_int64_t last_tsc;
+	struct Swap_stats ss;
+	u_int64_t now;
+
+	swap_stats(&ss);
+	if (ss.ss_nslots == 0) {
+		printf("  no swap disk\n");
+		return;
+	}
+	now = read_tsc();
+
+	printf("  %d of %d slots in use (%dK)\n", ss.ss_inuse,
+		ss.ss_nslots, ss.ss_inuse * (BY2PG / 1024));
+	printf("  %d pages in, %d out; %d and %d cycles each\n",
+		ss.ss_nin, ss.ss_nout,
+		ss.ss_nin ? (u_int)(ss.ss_cycles_in / ss.ss_nin) : 0,
+		ss.ss_nout ? (u_int)(ss.ss_cycles_out / ss.ss_nout) : 0);
+	if (last_tsc)
+		printf("  %d in, %d out over the %d Mcycles since the last look\n",
+			ss.ss_nin - last.ss_nin, ss.ss_nout - last.ss_nout,
+			(u_int)((now - last_tsc) / 1000000));
+	last = ss;
+	last_tsc = now;
+}
+
+// Print the mapping of a page at va in pgdir, for pagemap.
+static void
+pagemap_print(Pde *pgdir, u_long va)
+{
+	u_int i;
+	Pte *pte;
+
+	for (i = 0; i < nenv; i++)
+		if (envs[i].env_pgdir == pgdir)
+			break;
+	pgdir_walk(pgdir, va, 0, &pte);
+	printf("    env %08x va %08lx perm %03x\n",
+		i < nenv ? envs[i].env_id : 0, va, (u_int)*pte & 0xfff);
+}
+
+void
+mon_pagemap(int argc, char **argv)
+{
+	struct Page *pp;
+	struct Rmap *rm;
+	Pde *other;
+	u_long pa;
+	u_int i, n, pdx;
+
+	if (argc < 2) {
+		printf("usage: pagemap <physical address>\n");
+		return;
+	}
+	pa = strtol(argv[1], 0, 16);
+	if (PPN(pa) >= npage) {
+		printf("  no page at %08lx\n", pa);
+		return;
+	}
+
+	pp = pa2page(pa);
+	printf("  page %08lx: %d references\n", page2pa(pp), pp->pp_ref);
+	n = 0;
+	RMAP_FOREACH(rm, pp) {
+		pagemap_print(rm->rm_pgdir, rm->rm_va);
+		n++;
+		// a table shared since fork is recorded under one of the
+		// page directories sharing it; list the others too
+		pdx = PDX(rm->rm_va);
+		if ((rm->rm_pgdir[pdx] & (PTE_P | PTE_W)) != PTE_P)
+			continue;
+		i = 0;
+		while ((other = page_table_sharer(rm->rm_pgdir, pdx, &i))) {
+			pagemap_print(other, rm->rm_va);
+			n++;
+		}
+	}
+	printf("  %d user mappings, %d records\n", n, rmap_count(pp));
+}
+
+void
+mon_rmapbench(int argc, char **argv)
+{
+	struct Page *pp;
+	Pde *pgdir;
+	u_int cr3, n, i;
+	u_int64_t t0, tall, trmap;
+
+	n = argc > 1 ? strtol(argv[1], 0, 10) : 10000;
+	if (n == 0 || pgdir_alloc(&pgdir, &cr3) < 0)
+		return;
+	if (page_alloc(&pp) < 0) {
+		pgdir_free(pgdir, cr3);
+		printf("rmapbench: out of memory\n");
+		return;
+	}
+	pp->pp_ref = 1;
+
+	// A second mapping keeps the page table there, so the loop
+	// times the PTE work alone.
+	if (page_insert(pgdir, pp, UTEXT + BY2PG, PTE_U) < 0)
+		goto out;
+
+	t0 = read_tsc();
+	for (i = 0; i < n; i++) {
+		if (page_insert(pgdir, pp, UTEXT, PTE_U) < 0)
+			break;
+		page_remove(pgdir, UTEXT);
+	}
+	tall = read_tsc() - t0;
+	n = i;
+
+	t0 = read_tsc();
+	for (i = 0; i < n; i++) {
+		if (rmap_add(pp, pgdir, UTEXT) < 0)
+			break;
+		rmap_remove(pp, pgdir, UTEXT);
+	}
+	trmap = read_tsc() - t0;
+
+	if (n > 0)
+		printf("  %d pairs: %d cycles each, %d of them (%d%%) "
+			"keeping the rmap\n", n, (u_int)(tall / n),
+			(u_int)(trmap / n), (u_int)(trmap * 100 / tall));
+	page_remove(pgdir, UTEXT + BY2PG);
+out:
+	pgdir_free(pgdir, cr3);
+	page_decref(pp);
+}
+
+void
+mon_ksminfo(int argc, char **argv)
+{
+	struct Ksm_stats ks;
+
+	ksm_stats(&ks);
+	printf("  %d merged pages, %d mappings of them, %d pages saved\n",
+		ks.ks_stable, ks.ks_mappings,
+		ks.ks_mappings > ks.ks_stable ? ks.ks_mappings - ks.ks_stable : 0);
+	printf("  %d candidates; %d pages hashed, %d mappings merged "
+		"in %d full scans\n", ks.ks_unstable, ks.ks_scanned,
+		ks.ks_merged, ks.ks_laps);
+}
+
+void
+mon_wsinfo(int argc, char **argv)
+{
+	struct Ws_stats ws;
+	struct Env **ev, *e;
+	u_int i, j, n, max;
+
+	max = argc > 1 ? strtol(argv[1], 0, 10) : nenv;
+	if ((ev = kmalloc(nenv * sizeof(ev[0]))) == 0) {
+		printf("wsinfo: out of memory\n");
+		return;
+	}
+
+	// insertion sort, largest working set first
+	n = 0;
+	for (i = 0; i < nenv; i++) {
+		if (envs[i].env_status == ENV_FREE
+		    || envs[i].env_status == ENV_DYING)
+			continue;
+		e = &envs[i];
+		for (j = n++; j > 0 && ev[j - 1]->env_ws < e->env_ws; j--)
+			ev[j] = ev[j - 1];
+		ev[j] = e;
+	}
+
+	ws_stats(&ws);
+	printf("  %d envs; %d laps, %d PTEs sampled\n", n, ws.ws_laps,
+		ws.ws_scanned);
+	printf("  env             ws  accessed   written    mapped\n");
+	for (i = 0; i < n && i < max; i++)
+		printf("  %08x  %8d  %8d  %8d  %8d\n", ev[i]->env_id,
+			ev[i]->env_ws, ev[i]->env_ws_ref, ev[i]->env_ws_dirty,
+			ev[i]->env_rss);
+	kfree(ev);
+}
+
 u_char* find_symbol(u_int);
 
 void
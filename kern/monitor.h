@@ -17,5 +17,15 @@ void mon_backtrace(int argc, char **argv);
 void mon_alloc_page(int argc, char **argv);
 void mon_page_status(int argc, char **argv);
 void mon_free_page(int argc, char **argv);
+void mon_buddyinfo(int argc, char **argv);
+void mon_kmeminfo(int argc, char **argv);
+void mon_ptinfo(int argc, char **argv);
+void mon_imageinfo(int argc, char **argv);
+void mon_envstress(int argc, char **argv);
+void mon_swapinfo(int argc, char **argv);
+void mon_pagemap(int argc, char **argv);
+void mon_rmapbench(int argc, char **argv);
+void mon_ksminfo(int argc, char **argv);
+void mon_wsinfo(int argc, char **argv);
 void mon_halt(int argc, char **argv);
 #endif	// not _KERN_MONITOR_H_
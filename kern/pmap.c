@@ -5,10 +5,16 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/e820.h>
+#include <inc/syscall.h>
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/kmalloc.h>
+#include <kern/vma.h>
+#include <kern/swap.h>
+#include <kern/rmap.h>
 
 u_long boot_cr3; /* Physical address of boot time pg dir */
 Pde* boot_pgdir;
@@ -17,11 +23,73 @@ struct Page *pages;
 /* These variables are set by i386_detect_memory() */
 u_long maxpa;            /* Maximum physical address */
 u_long npage;            /* Amount of memory(in pages) */
+u_long nhighpage;        /* PAE: pages of pages[] past npage, in highmem */
 u_long basemem;          /* Amount of base memory(in bytes) */
 u_long extmem;           /* Amount of extended memory(in bytes) */
 
+// The BIOS memory map, copied out of the boot loader's page by
+// i386_detect_memory() before page_init() can hand that page out.
+static struct E820_map e820;
+
 static u_long freemem;    /* Pointer to next byte of free mem */
-static struct Page_list page_free_list;	/* Free list of physical pages */
+
+// Page-table pages in use: those boot_pgdir_walk() built, and those
+// page_table_alloc() has handed out since.
+static u_long pt_boot;
+static u_long pt_alloced;
+// Page tables pgdir_share_cow() has shared with a child, and copies
+// page_table_unshare() has made of them since.
+static u_long pt_shared;
+static u_long pt_copied;
+// Nonzero while page_table_unshare() is moving a table's reverse
+// mappings; page_alloc() must not reap destroyed envs then.
+static u_int pt_unsharing;
+// Buddy free lists: page_free_lists[k] holds free blocks of 2^k pages.
+static struct Page_list page_free_lists[PAGE_MAXORDER + 1];
+
+// Free physical memory that page_init() has not yet split into
+// buddy blocks (PAGE_LAZY_INIT only), as [pr_start, pr_end) page
+// numbers.  page_carve() turns it into blocks when the lists run dry.
+#define PAGE_NRANGES	(E820_MAX + 1)
+struct Page_range {
+	u_long pr_start;
+	u_long pr_end;
+};
+static struct Page_range page_ranges[PAGE_NRANGES];
+static int page_nranges;
+
+// Pages that have already been cleared, refilled while the idle
+// environment runs so that page_alloc_zeroed() rarely has to memset.
+static struct Page_list page_zero_list;
+static u_long page_zero_count;
+
+#ifdef PAE
+// Free highmem: pages from page_free(), and the memory map's ranges
+// that page_alloc_user() has not yet taken any page from.
+static struct Page_list page_high_list;
+static struct Page_range page_high_ranges[E820_MAX];
+static int page_high_nranges;
+// The PTEs of the page_kmap() slots, and how many are in use.
+static Pte *kmap_pte;
+static u_int kmap_depth;
+#endif
+
+// Set once CR4_PSE is on and 4MB superpage PDEs may be used.
+static int pse_enabled;
+// Set if the CPU supports global pages.  The kernel mappings are
+// built with PTE_G, but CR4_PGE is only turned on once paging is
+// fully set up.
+static int pge_enabled;
+
+// Pending TLB invalidations, queued by tlb_invalidate() between
+// tlb_batch_begin() and tlb_batch_flush().
+static struct {
+	Pde *pgdir;		// page directory being edited, 0 if idle
+	int n;			// number of entries in va[]
+	int overflow;		// more than TLB_BATCH_MAX pages queued
+	int global;		// some queued page is above UTOP
+	u_long va[TLB_BATCH_MAX];
+} tlb_batch;
 
 // Global descriptor table.
 //
@@ -61,27 +129,114 @@ nvram_read(int r)
 	return mc146818_read(NULL, r) | (mc146818_read(NULL, r+1)<<8);
 }
 
+//
+// Clip memory map entry e to the physical memory the kernel can
+// reach through its KERNBASE window, and return it as the byte range
+// [*start, *end).  Returns 0 if nothing usable is left.
+//
+static int
+e820_clip(struct E820_entry *e, u_long *start, u_long *end)
+{
+	u_int64_t lim = (u_long)-KERNBASE, s, t;
+
+	if (e->e_type != E820_RAM || e->e_addr >= lim)
+		return 0;
+	s = e->e_addr;
+	t = e->e_addr + e->e_len;
+	if (t > lim)
+		t = lim;
+	*start = ROUND((u_long)s, BY2PG);
+	*end = ROUNDDOWN((u_long)t, BY2PG);
+	return *start < *end;
+}
+
+#ifdef PAE
+//
+// Clip memory map entry e to highmem, the RAM above the KERNBASE
+// window, below page number lim, and return it as the page numbers
+// [*start, *end).  Returns 0 if there is none.
+//
+static int
+e820_clip_high(struct E820_entry *e, u_long lim, u_long *start, u_long *end)
+{
+	u_int64_t s, t;
+
+	if (e->e_type != E820_RAM)
+		return 0;
+	s = MAX(e->e_addr, (u_int64_t)(u_long)-KERNBASE);
+	t = MIN(e->e_addr + e->e_len, (u_int64_t)lim << PGSHIFT);
+	if (s >= t)
+		return 0;
+	*start = (s + BY2PG - 1) >> PGSHIFT;
+	*end = t >> PGSHIFT;
+	return *start < *end;
+}
+#endif
+
+static void
+e820_add(u_long addr, u_long len)
+{
+	struct E820_entry *e = &e820.m_entry[e820.m_nr++];
+
+	e->e_addr = addr;
+	e->e_len = len;
+	e->e_type = E820_RAM;
+}
+
 void
 i386_detect_memory(void)
 {
-	// CMOS tells us how many kilobytes there are
-	basemem = ROUNDDOWN(nvram_read(NVRAM_BASELO)*1024, BY2PG);
-	extmem = ROUNDDOWN(nvram_read(NVRAM_EXTLO)*1024, BY2PG);
-
-	printf("get ext memory=%dK\n", nvram_read(NVRAM_EXTLO));
-	extmem = ROUNDDOWN(nvram_read(NVRAM_EXTLO)*1024, BY2PG);
+	struct E820_map *m = (struct E820_map *)(KERNBASE + E820_MAP);
+	u_long start, end;
+	int i;
+#ifdef PAE
+	u_long lim, high;
+#endif
+
+	if (m->m_nr > 0 && m->m_nr <= E820_MAX)
+		e820 = *m;
+	else {
+		// No map from the BIOS, so describe what the CMOS
+		// tells us (in kilobytes) the same way.
+		e820.m_nr = 0;
+		e820_add(0, ROUNDDOWN(nvram_read(NVRAM_BASELO)*1024, BY2PG));
+		e820_add(EXTPHYSMEM,
+			ROUNDDOWN(nvram_read(NVRAM_EXTLO)*1024, BY2PG));
+	}
 
-	// Calculate the maxmium physical address based on whether
-	// or not there is any extended memory.  See comment in ../inc/mmu.h.
-	if (extmem)
-		maxpa = EXTPHYSMEM + extmem;
-	else
-		maxpa = basemem;
+	// Memory above what KERNBASE can map is left unused.
+	maxpa = basemem = extmem = 0;
+	for (i = 0; i < e820.m_nr; i++) {
+		if (!e820_clip(&e820.m_entry[i], &start, &end))
+			continue;
+		maxpa = MAX(maxpa, end);
+		if (start < IOPHYSMEM)
+			basemem += MIN(end, (u_long)IOPHYSMEM) - start;
+		if (end > EXTPHYSMEM)
+			extmem += end - MAX(start, (u_long)EXTPHYSMEM);
+	}
 
 	npage = maxpa / BY2PG;
 
 	printf("Physical memory: %dK available, ", (u_int)(maxpa/1024));
-	printf("base = %dK, extended = %dK\n", (int)(basemem/1024), (int)(extmem/1024));
+	printf("base = %dK, extended = %dK, %d map entries\n",
+		(int)(basemem/1024), (int)(extmem/1024), e820.m_nr);
+
+#ifdef PAE
+	// With PAE the RAM above the window is highmem, for user pages.
+	// Its struct Pages come out of the window and show through
+	// UPAGES, so use only as much as pages[] can describe in a
+	// quarter of the window's memory and in UPAGESIZE.
+	lim = MIN((u_long)UPAGESIZE, maxpa / 4) / sizeof(struct Page);
+	high = nhighpage = 0;
+	for (i = 0; i < e820.m_nr; i++) {
+		if (!e820_clip_high(&e820.m_entry[i], lim, &start, &end))
+			continue;
+		nhighpage = MAX(nhighpage, end - npage);
+		high += end - start;
+	}
+	printf("Highmem: %dK available\n", (u_int)(high * (BY2PG/1024)));
+#endif
 }
 
 // --------------------------------------------------------------
@@ -101,7 +256,7 @@ static void check_boot_pgdir(void);
 // This function may ONLY be used during initialization,
 // before the page_free_list has been set up.
 // 
-static void *
+void *
 alloc(u_int n, u_int align, int clear)
 {
 	extern char end[];
@@ -144,6 +299,9 @@ alloc(u_int n, u_int align, int clear)
 //	- if create == 0, return 0.
 //	- otherwise allocate a new page table and install it.
 //
+// If va is covered by a 4MB superpage, the page directory entry
+// itself is returned; the caller can tell by its PTE_PS bit.
+//
 // This function is abstracting away the 2-level nature of
 // the page directory for us by allocating new page tables
 // as needed.
@@ -155,24 +313,19 @@ alloc(u_int n, u_int align, int clear)
 static Pte*
 boot_pgdir_walk(Pde *pgdir, u_long va, int create)
 {
-	int pdIndex, ptIndex;
-	
-
-	pdIndex = PDX(va);
-	ptIndex = PTX(va);
+	Pde *pde = &pgdir[PDX(va)];
 
-	Pte *ptEntries = pgdir[pdIndex];
-	if(ptEntries[ptIndex] == 0)
-	{
-		if(create)
-			ptEntries[ptIndex] = PADDR(alloc(BY2PG, BY2PG, 1));
-		else
+	if (!(*pde & PTE_P)) {
+		if (!create)
 			return 0;
-
+		// the PTEs carry the real permissions
+		*pde = PADDR(alloc(BY2PG, BY2PG, 1)) | PTE_U | PTE_W | PTE_P;
+		pt_boot++;
 	}
 
-	return ptEntries[ptIndex];
-
+	if (*pde & PTE_PS)
+		return (Pte *)pde;
+	return (Pte *)KADDR(PTE_ADDR(*pde)) + PTX(va);
 }
 
 //
@@ -180,27 +333,87 @@ boot_pgdir_walk(Pde *pgdir, u_long va, int create)
 // in the page table rooted at pgdir.  Size is a multiple of BY2PG.
 // Use permission bits perm|PTE_P for the entries.
 //
+// When the CPU supports PSE, every 4MB-aligned, 4MB-long piece of
+// the range is mapped with a single superpage PDE instead of a
+// page table full of PTEs.
+//
+// Everything mapped here is identical in every address space, so
+// the mappings are made global (PTE_G) and survive CR3 reloads.
+//
 // This function may ONLY be used during initialization,
 // before the page_free_list has been set up.
 //
 static void
 boot_map_segment(Pde *pgdir, u_long va, u_long size, u_long pa, int perm)
 {
-	int entriesCount, i;
-
-	Pte* pte;
+	u_long off;
+	Pte *pte;
 
 	perm |= PTE_P;
-	entriesCount = size / BY2PG;
+	if (pge_enabled)
+		perm |= PTE_G;
+	for (off = 0; off < size; ) {
+		if (pse_enabled && ((va + off) & (PDMAP-1)) == 0
+		    && ((pa + off) & (PDMAP-1)) == 0 && size - off >= PDMAP) {
+			assert(!(pgdir[PDX(va + off)] & PTE_P));
+			pgdir[PDX(va + off)] = (pa + off) | perm | PTE_PS;
+			off += PDMAP;
+			continue;
+		}
+		pte = boot_pgdir_walk(pgdir, va + off, 1);
+		assert(!(*pte & PTE_PS));
+		*pte = (pa + off) | perm;
+		off += BY2PG;
+	}
+}
+
+//
+// Turn on 4MB pages if the CPU has them, and note whether it has
+// global pages.
+// Must be called before paging is enabled, since boot_map_segment
+// only builds superpage and global entries once these are set.
+//
+static void
+pse_init(void)
+{
+	u_int edx;
+
+	cpuid(1, 0, 0, 0, &edx);
+#ifdef PAE
+	// PAE page directories always allow (2MB) superpages.
+	if (!(edx & CPUID_FEAT_PAE))
+		panic("kernel built for PAE, but the CPU lacks it");
+	lcr4(rcr4() | CR4_PAE);
+	pse_enabled = 1;
+#else
+	if (edx & CPUID_FEAT_PSE) {
+		lcr4(rcr4() | CR4_PSE);
+		pse_enabled = 1;
+	}
+#endif
+	if (edx & CPUID_FEAT_PGE)
+		pge_enabled = 1;
+}
+
+//
+// Point the VPT and UVPT entries of pgdir at pgdir itself.
+// With PAE that takes one entry for each of the four directories.
+//
+void
+pgdir_map_vpt(Pde *pgdir)
+{
+	u_long pa = PADDR(pgdir);
+	int i;
 
-	for(i = 0; i < entriesCount; i++)
-	{
-		pte = boot_pgdir_walk(pgdir, va + i*BY2PG, 1);
-		*pte = (pa + i*BY2PG) | perm;
+	for (i = 0; i < VPTSIZE / PDMAP; i++) {
+		// Permissions: kernel RW, user NONE
+		pgdir[PDX(VPT) + i] = (pa + i * BY2PG) | PTE_W | PTE_P;
+		// Permissions: kernel R, user R
+		pgdir[PDX(UVPT) + i] = (pa + i * BY2PG) | PTE_U | PTE_P;
 	}
 }
 
-// Set up a two-level page table:
+// Set up a two-level page table (three-level with PAE):
 //    boot_pgdir is its virtual address of the root
 //    boot_cr3 is the physical adresss of the root
 // Then turn on paging.  Then effectively turn off segmentation.
@@ -217,27 +430,36 @@ i386_vm_init(void)
 {
 	Pde *pgdir;
 	u_int cr0, n;
+	int i;
+#ifdef PAE
+	Pde *pdpt;
+#endif
 
 //	panic("i386_vm_init: This function is not finished\n");
 
+	pse_init();
+
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
-	pgdir = alloc(BY2PG, BY2PG, 1);
+	pgdir = alloc(PDE2PD * sizeof(Pde), BY2PG, 1);
 	boot_pgdir = pgdir;
+#ifdef PAE
+	// CR3 points at the PDPT, whose entries may only have PTE_P set.
+	pdpt = alloc(PDPTE2PDPT * sizeof(Pde), 32, 1);
+	for (i = 0; i < PDPTE2PDPT; i++)
+		pdpt[i] = (PADDR(pgdir) + i * BY2PG) | PTE_P;
+	boot_cr3 = PADDR(pdpt);
+#else
 	boot_cr3 = PADDR(pgdir);
+#endif
 
 	//////////////////////////////////////////////////////////////////////
 	// Recursively insert PD in itself as a page table, to form
-	// a virtual page table at virtual address VPT.
-	// (For now, you don't have understand the greater purpose of the
-	// following two lines.)
-
-	// Permissions: kernel RW, user NONE
-	pgdir[PDX(VPT)] = PADDR(pgdir)|PTE_W|PTE_P;
-
-	// same for UVPT
-	// Permissions: kernel R, user R 
-	pgdir[PDX(UVPT)] = PADDR(pgdir)|PTE_U|PTE_P;
+	// a virtual page table at virtual address VPT, and the same
+	// read-only for users at UVPT.
+	// (For now, you don't have understand the greater purpose of
+	// this.)
+	pgdir_map_vpt(pgdir);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map the kernel stack (symbol name "bootstack"):
@@ -245,45 +467,25 @@ i386_vm_init(void)
 	//     * [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
 	//     * [KSTACKTOP-PDMAP, KSTACKTOP-KSTKSIZE) -- not backed => faults
 	//   Permissions: kernel RW, user NONE
-	// Your code goes here:
-	Pte *ptable = alloc(BY2PG, BY2PG, 1);
-	u_long vstkBottom = KSTACKTOP - KSTKSIZE;
-
-	pgdir[PDX(vstkBottom)] = PADDR(ptable)|PTE_W|PTE_P;
-	
-	int stkPages = KSTKSIZE / BY2PG;
-	int i;
-
-	for(i = 0; i < stkPages; i++)
-	{
-		ptable[PTX(vstkBottom) + i] = (PADDR(bootstack) | PTE_W | PTE_P) + i*BY2PG;
-	}
+	boot_map_segment(pgdir, KSTACKTOP - KSTKSIZE, KSTKSIZE,
+		PADDR(bootstack), PTE_W);
+#ifdef PAE
+	// The page_kmap() slots share the stack's page table; every
+	// address space gets them with the rest of the kernel part.
+	static_assert(KMAPBASE + KMAP_NSLOT * BY2PG <= KSTACKTOP - KSTKSIZE);
+	kmap_pte = boot_pgdir_walk(pgdir, KMAPBASE, 1);
+#endif
 
-	
 	//////////////////////////////////////////////////////////////////////
-	// Map UENV point to NENV of struct Env
+	// Map UENV point to nenv of struct Env
+	// Size the table from the amount of memory, but never beyond
+	// what envids can index or the UENVS window can show.
 	//
-	int envSize = NENV * sizeof(struct Env);
-	int envPages = ROUND(envSize, BY2PG) / BY2PG;
-	int envVa, pdx, pte;
-
-	u_long tempVa = 0, paAddr;
-	int ptej, tempSize = 0;
-
-	ptable = alloc(BY2PG, BY2PG, 1);
-
-	pdx = PDX(UENVS);
-	pgdir[pdx] = PADDR(ptable) | PTE_U | PTE_P;
-
-	envs = alloc(envSize, BY2PG, 1);
-
-	for( i = 0; i < envPages; i++)
-	{
-
-		ptable[i] = (PADDR(envs) + tempSize) | PTE_U | PTE_P;
-		tempSize += BY2PG;
-		
-	}
+	nenv = MIN(npage / ENV_NPAGES, (u_long)NENV);
+	nenv = MIN(nenv, UENVSIZE / sizeof(struct Env));
+	n = ROUND(nenv * sizeof(struct Env), BY2PG);
+	envs = alloc(n, BY2PG, 1);
+	boot_map_segment(pgdir, UENVS, n, PADDR(envs), PTE_U);
 
 	//////////////////////////////////////////////////////////////////////
 	// Make 'pages' point to an array of size 'npage' of 'struct Page'.   
@@ -293,19 +495,9 @@ i386_vm_init(void)
 	// Permissions:
 	//    - pages -- kernel RW, user NONE
 	//    - the image mapped at UPAGES  -- kernel R, user R
-	// Your code goes here: 
-	
-	pages = alloc(npage * sizeof(struct Page), BY2PG, 1);
-	ptable = alloc(BY2PG, BY2PG, 1);
-
-	pgdir[PDX(UPAGES)] = PADDR(ptable) | PTE_U | PTE_P;
-
-	int nstructPages = ROUND(npage * sizeof(struct Page), BY2PG) / BY2PG;
-
-	for( i = 0; i < nstructPages; i++)
-	{
-		ptable[PTX(UPAGES) +i ] = (PADDR(pages) + i*BY2PG ) | PTE_U | PTE_P;
-	}
+	n = ROUND((npage + nhighpage) * sizeof(struct Page), BY2PG);
+	pages = alloc(n, BY2PG, 1);
+	boot_map_segment(pgdir, UPAGES, n, PADDR(pages), PTE_U);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE. 
@@ -314,26 +506,8 @@ i386_vm_init(void)
 	// We might not have that many(ie. 2^32 - 1 - KERNBASE)    
 	// bytes of physical memory.  But we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
-	// Your code goes here: 
-	
-	u_int tkb = KERNBASE;
-	u_long phy_addr = 0;
-	int j;
-
-	for( ; tkb != 0; tkb += BY2PG*1024)
-	{
-		ptable = alloc(BY2PG, BY2PG, 1);
-		pgdir[PDX(tkb)] = PADDR(ptable) | PTE_P | PTE_W;
-
-		for(j = 0; j < 1024; j++)
-		{
-			ptable[j] = phy_addr | PTE_P | PTE_W;
-			phy_addr += BY2PG;
-		}
-
-
-	}
-
+	// With PSE this takes 64 superpage PDEs and no page tables.
+	boot_map_segment(pgdir, KERNBASE, -KERNBASE, 0, PTE_W);
 
 	check_boot_pgdir();
 
@@ -355,7 +529,8 @@ i386_vm_init(void)
 
 	// Map VA 0:4MB same as VA KERNBASE, i.e. to PA 0:4MB.
 	// (Limits our kernel to <4MB)
-	pgdir[0] = pgdir[PDX(KERNBASE)];
+	for (i = 0; i < 4*1024*1024 / PDMAP; i++)
+		pgdir[i] = pgdir[PDX(KERNBASE) + i];
 
 	// Install page table.
 	lcr3(boot_cr3);
@@ -383,10 +558,16 @@ i386_vm_init(void)
 
 	// This mapping was only used after paging was turned on but
 	// before the segment registers were reloaded.
-	pgdir[0] = 0;
+	for (i = 0; i < 4*1024*1024 / PDMAP; i++)
+		pgdir[i] = 0;
 
 	// Flush the TLB for good measure, to kill the pgdir[0] mapping.
 	lcr3(boot_cr3);
+
+	// Only now turn on global pages: pgdir[0] was a copy of a
+	// global entry, and a CR3 reload would not have flushed it.
+	if (pge_enabled)
+		lcr4(rcr4() | CR4_PGE);
 }
 
 //
@@ -402,25 +583,18 @@ static u_long va2pa(Pde *pgdir, u_long va);
 static void
 check_boot_pgdir(void)
 {
-	u_long i, n;
+	u_long i, n, pn, en;
 	Pde *pgdir;
 
 	pgdir = boot_pgdir;
 
 	// check pages array
-	n = ROUND(npage*sizeof(struct Page), BY2PG);
+	pn = n = ROUND((npage + nhighpage)*sizeof(struct Page), BY2PG);
 	for(i=0; i<n; i+=BY2PG)
 		assert(va2pa(pgdir, UPAGES+i) == PADDR(pages)+i);
 	
 	// check envs array
-	n = ROUND(NENV*sizeof(struct Env), BY2PG);
-	for(i=0; i<n; i+=BY2PG)
-		{
-		printf("%d  %d\n", va2pa(pgdir, UENVS+i), PADDR(envs)+i);
-		assert(va2pa(pgdir, UENVS+i) == PADDR(envs)+i);
-		}
-	// check envs array
-	n = ROUND(NENV*sizeof(struct Env), BY2PG);
+	en = n = ROUND(nenv*sizeof(struct Env), BY2PG);
 	for(i=0; i<n; i+=BY2PG)
 		assert(va2pa(pgdir, UENVS+i) == PADDR(envs)+i);
 
@@ -428,28 +602,40 @@ check_boot_pgdir(void)
 	for(i=0; KERNBASE+i != 0; i+=BY2PG)
 		assert(va2pa(pgdir, KERNBASE+i) == i);
 
+	// with PSE the window is all superpages
+	if (pse_enabled)
+		for(i=0; KERNBASE+i != 0; i+=PDMAP)
+			assert(pgdir[PDX(KERNBASE+i)] & PTE_PS);
+
+	// and with PGE it is global
+	if (pge_enabled)
+		for(i=0; KERNBASE+i != 0; i+=BY2PG)
+			assert(*boot_pgdir_walk(pgdir, KERNBASE+i, 0) & PTE_G);
+
 	// check kernel stack
 	for(i=0; i<KSTKSIZE; i+=BY2PG)
 		assert(va2pa(pgdir, KSTACKTOP-KSTKSIZE+i) == PADDR(bootstack)+i);
 
+	// without PSE, the KERNBASE window needs a page table per PDMAP
+	if (!pse_enabled)
+		assert(pt_boot >= (u_long)-KERNBASE / PDMAP);
+
 	// check for zero/non-zero in PDEs
 	for (i = 0; i < PDE2PD; i++) {
-		switch (i) {
-		case PDX(VPT):
-		case PDX(UVPT):
-		case PDX(KSTACKTOP-1):
-		case PDX(UPAGES):
-		case PDX(UENVS):
+		if ((i >= PDX(VPT) && i < PDX(VPT) + VPTSIZE/PDMAP)
+		    || (i >= PDX(UVPT) && i < PDX(UVPT) + VPTSIZE/PDMAP))
 			assert(pgdir[i]);
-			break;
-		default:
-			if(i >= PDX(KERNBASE))
-				assert(pgdir[i]);
-			else
-				assert(pgdir[i]==0);
-			break;
-		}
+		else if (i == PDX(KSTACKTOP-1)
+		    || (i >= PDX(UPAGES) && i <= PDX(UPAGES + pn - 1))
+		    || (i >= PDX(UENVS) && i <= PDX(UENVS + en - 1)))
+			assert(pgdir[i]);
+		else if(i >= PDX(KERNBASE))
+			assert(pgdir[i]);
+		else
+			assert(pgdir[i]==0);
 	}
+	printf("check_boot_pgdir: %d boot page tables (%dK)\n",
+		pt_boot, pt_boot * BY2PG / 1024);
 	printf("check_boot_pgdir() succeeded!\n");
 }
 
@@ -461,6 +647,8 @@ va2pa(Pde *pgdir, u_long va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir&PTE_P))
 		return ~0;
+	if (*pgdir&PTE_PS)
+		return PTE_ADDR_PS(*pgdir) + PTE_ADDR(va & (PDMAP-1));
 	p = (Pte*)KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)]&PTE_P))
 		return ~0;
@@ -472,6 +660,10 @@ va2pa(Pde *pgdir, u_long va)
 // --------------------------------------------------------------
 
 static void page_initpp(struct Page *pp);
+static void page_free_range(u_long start, u_long end);
+static int  pte_insert(Pde *, Pte *, struct Page *, u_long va, u_int perm);
+static int  pte_remove(Pde *, Pte *, u_long va);
+static void page_free_usable(u_long start, u_long end);
 
 //  
 // Initialize page structure and memory free list.
@@ -496,24 +688,28 @@ page_init(void)
 	//
 	// Change the code to reflect this.
 	int i;
-	unsigned int va = KERNBASE;
+	u_int64_t t0;
 
 	extern char end[];
 
-	LIST_INIT (&page_free_list);
+	t0 = read_tsc();
+
+	for (i = 0; i <= PAGE_MAXORDER; i++)
+		LIST_INIT(&page_free_lists[i]);
+	LIST_INIT(&page_zero_list);
+	page_zero_count = 0;
+	page_nranges = 0;
+	// alloc() handed us the pages array already zeroed, so every
+	// page starts out with pp_ref, pp_order and pp_free all 0.
 
 	// first 4k in use
 	pages[0].pp_ref = 1;
 
 	// 4k ~ 640k mark as free
-	for (i = 1; i*BY2PG < IOPHYSMEM; i++)
-	{
-		pages[i].pp_ref = 0;
-		LIST_INSERT_HEAD(&page_free_list, &pages[i], pp_link);
-	}
+	page_free_usable(1, PPN(IOPHYSMEM));
 
 	// 640k ~ 1M in use for IO
-	for( ; i*BY2PG < EXTPHYSMEM; i++)
+	for (i = PPN(IOPHYSMEM); i < PPN(EXTPHYSMEM); i++)
 		pages[i].pp_ref = 1;
 
 	// kernel in use
@@ -521,24 +717,31 @@ page_init(void)
 	for( ; i*BY2PG < kern_end - KERNBASE; i++)
 		pages[i].pp_ref = 1;
 
-	// pgdir & pgentries 4k * 4k = 16M
-	u_long pgdir_end = kern_end + 16 * 1024 * 1024;
+	// everything alloc() handed out is in use: boot_pgdir, the
+	// boot page tables, envs and pages.  Later page tables come
+	// from page_table_alloc().
+	u_long alloc_end = ROUND(freemem, BY2PG);
 
-	for( ; i*BY2PG < pgdir_end - KERNBASE; i++)
+	for( ; i*BY2PG < alloc_end - KERNBASE; i++)
 		pages[i].pp_ref = 1;
 
-	// space for pages is in use
-	u_long pages_end = ROUND(pgdir_end + npage * sizeof(struct Page), BY2PG);
+	// the left memory mark as free, skipping holes in the memory map
+	page_free_usable(i, npage);
 
-	for( ; i*BY2PG < pages_end - KERNBASE; i++)
-		pages[i].pp_ref = 1;
+#ifdef PAE
+	// highmem is handed out a page at a time by page_alloc_user()
+	LIST_INIT(&page_high_list);
+	page_high_nranges = 0;
+	for (i = 0; i < e820.m_nr; i++)
+		if (e820_clip_high(&e820.m_entry[i], npage + nhighpage,
+				&page_high_ranges[page_high_nranges].pr_start,
+				&page_high_ranges[page_high_nranges].pr_end))
+			page_high_nranges++;
+#endif
 
-	// the left memory mark as free
-	for( ; i < npage; i++)
-	{
-		pages[i].pp_ref = 0;
-		LIST_INSERT_HEAD(&page_free_list, &pages[i], pp_link);
-	}
+	printf("page_init: %d pages free, %lld cycles (%s)\n",
+		page_free_stats(0), read_tsc() - t0,
+		PAGE_LAZY_INIT ? "lazy" : "eager");
 
 	/*
 	for (i = 0;va && i < npage; i++) {
@@ -577,6 +780,97 @@ page_init(void)
 
 }
 
+//
+// Order of the biggest buddy block that can start at page s
+// without running past page e.
+//
+static int
+page_range_order(u_long s, u_long e)
+{
+	int o = 0;
+
+	while (o < PAGE_MAXORDER && (s & ((2 << o) - 1)) == 0
+	       && s + (2 << o) <= e)
+		o++;
+	return o;
+}
+
+//
+// Free the pages in [start, end) that the memory map says are RAM.
+//
+static void
+page_free_usable(u_long start, u_long end)
+{
+	u_long s, e;
+	int i;
+
+	for (i = 0; i < e820.m_nr; i++) {
+		if (!e820_clip(&e820.m_entry[i], &s, &e))
+			continue;
+		page_free_range(MAX(start, PPN(s)), MIN(end, PPN(e)));
+	}
+}
+
+//
+// Hand pages [start, end) to the allocator.
+// With PAGE_LAZY_INIT the range is only recorded, and no struct Page
+// in it is touched until page_carve() needs it; otherwise each page
+// is freed right away.
+//
+static void
+page_free_range(u_long start, u_long end)
+{
+	struct Page_range *pr;
+
+	if (start >= end)
+		return;
+
+	if (!PAGE_LAZY_INIT) {
+		for (; start < end; start++)
+			page_free(&pages[start]);
+		return;
+	}
+
+	if (page_nranges > 0
+	    && page_ranges[page_nranges - 1].pr_end == start) {
+		page_ranges[page_nranges - 1].pr_end = end;
+		return;
+	}
+	if (page_nranges == PAGE_NRANGES)
+		panic("page_free_range: too many free ranges");
+	pr = &page_ranges[page_nranges++];
+	pr->pr_start = start;
+	pr->pr_end = end;
+}
+
+//
+// Move recorded free memory onto the buddy lists until there is a
+// block of at least 2^order pages.  Blocks are carved from the low
+// end of the first range, each as big and aligned as it can be.
+// Returns 0 on success, -E_NO_MEM if the ranges are used up first.
+//
+static int
+page_carve(int order)
+{
+	struct Page_range *pr;
+	int i, o;
+
+	while (page_nranges > 0) {
+		pr = &page_ranges[0];
+		o = page_range_order(pr->pr_start, pr->pr_end);
+		page_free_order(&pages[pr->pr_start], o);
+		pr->pr_start += 1 << o;
+		if (pr->pr_start == pr->pr_end) {
+			page_nranges--;
+			for (i = 0; i < page_nranges; i++)
+				page_ranges[i] = page_ranges[i + 1];
+		}
+		if (o >= order)
+			return 0;
+	}
+	return -E_NO_MEM;
+}
+
 //
 // Initialize a Page structure.
 //
@@ -586,6 +880,17 @@ page_initpp(struct Page *pp)
 	memset(pp, 0, sizeof(*pp));
 }
 
+//
+// Put the free block of 2^order pages headed by pp on its free list.
+//
+static void
+buddy_insert(struct Page *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_free = 1;
+	LIST_INSERT_HEAD(&page_free_lists[order], pp, pp_link);
+}
+
 //
 // Allocates a physical page.
 // Does NOT clear the contents of the page to zero -
@@ -603,159 +908,757 @@ page_initpp(struct Page *pp)
 int
 page_alloc(struct Page **pp)
 {
-	// Fill this function in
-	struct Page *p = LIST_FIRST(&page_free_list);
-
-	if(p == NULL)
-	    return -E_NO_MEM;
+	// Fast path: take a single page straight off the order-0 list.
+	struct Page *p = LIST_FIRST(&page_free_lists[0]);
+
+	if(p == NULL) {
+		// Out of free blocks: fall back on the pre-zeroed pool,
+		// then on what destroyed envs still hold, and only then
+		// on swapping a user page out.
+		if (page_alloc_order(0, pp) == 0)
+			return 0;
+		if ((p = LIST_FIRST(&page_zero_list)) == NULL) {
+			if ((pt_unsharing || env_reap(ENV_REAP_ALLOC) == 0)
+			    && swap_out() < 0)
+				return -E_NO_MEM;
+			return page_alloc(pp);
+		}
+		LIST_REMOVE(p, pp_link);
+		page_zero_count--;
+		*pp = p;
+		return 0;
+	}
 
 	LIST_REMOVE(p, pp_link);
+	p->pp_free = 0;
 
-	//p->pp_ref= 0;
 	*pp = p;
+	return 0;
+}
+
+//
+// Like page_alloc, but the page is guaranteed to be filled with zeros.
+// Takes a page from the pre-zeroed pool if it can, and only clears
+// one on the spot when the pool is empty.
+//
+int
+page_alloc_zeroed(struct Page **pp)
+{
+	struct Page *p;
+	int r;
 
+	if ((p = LIST_FIRST(&page_zero_list)) != NULL) {
+		LIST_REMOVE(p, pp_link);
+		page_zero_count--;
+		*pp = p;
+		return 0;
+	}
 
+	if ((r = page_alloc(&p)) < 0)
+		return r;
+	memset((void *)page2kva(p), 0, BY2PG);
+	*pp = p;
 	return 0;
 }
 
 //
-// Return a page to the free list.
-// (This function should only be called when pp->pp_ref reaches 0.)
+// Clear up to n free pages into the pre-zeroed pool, stopping once
+// the pool holds PAGE_ZERO_POOL pages or memory runs out.
+// Called from the idle path, so the clearing happens off the
+// critical path of whoever needs a clean page next.
 //
 void
-page_free(struct Page *pp)
+page_zero_refill(int n)
 {
-	// Fill this function in
-	//pp->pp_ref--;
+	struct Page *p;
 
-	LIST_INSERT_HEAD(&page_free_list, pp, pp_link);
+	while (n-- > 0 && page_zero_count < PAGE_ZERO_POOL) {
+		// only free memory: not worth swapping anything out for
+		if (page_alloc_order(0, &p) < 0)
+			break;
+		memset((void *)page2kva(p), 0, BY2PG);
+		LIST_INSERT_HEAD(&page_zero_list, p, pp_link);
+		page_zero_count++;
+	}
 }
 
 //
-// Decrement the reference count on a page, freeing it if there are no more refs.
+// Number of pages waiting in the pre-zeroed pool.
 //
-void
-page_decref(struct Page *pp)
+u_long
+page_zero_pooled(void)
 {
-	if (--pp->pp_ref == 0)
-		page_free(pp);
+	return page_zero_count;
 }
 
+#ifdef PAE
 //
-// This is boot_pgdir_walk with a different allocate function.
-// Unlike boot_pgdir_walk, pgdir_walk can fail, so we have to
-// return pte via a pointer parameter.
+// Take a free highmem page, or return 0 if there is none.
 //
-// Stores address of page table entry in *ppte.
-// Stores 0 if there is no such entry or on error.
-// 
-// RETURNS: 
-//   0 on success
-//   -E_NO_MEM, if page table couldn't be allocated
+static struct Page *
+page_high_take(void)
+{
+	struct Page_range *pr;
+	struct Page *p;
+
+	if ((p = LIST_FIRST(&page_high_list)) != NULL)
+		LIST_REMOVE(p, pp_link);
+	else if (page_high_nranges > 0) {
+		pr = &page_high_ranges[page_high_nranges - 1];
+		p = &pages[--pr->pr_end];
+		if (pr->pr_start == pr->pr_end)
+			page_high_nranges--;
+	} else
+		return 0;
+	p->pp_free = 0;
+	p->pp_flags = 0;
+	return p;
+}
+
+//
+// Allocate a page for user memory: from highmem while it lasts, and
+// from page_alloc() after that.  The kernel may touch it only through
+// page_kmap().
 //
 int
-pgdir_walk(Pde *pgdir, u_long va, int create, Pte **ppte)
+page_alloc_user(struct Page **pp)
 {
-	// Fill this function in
-	
-	int ret = 0;
-	int pdeIndex = PDX(va);
-	int pteIndex = PTX(va);
-
-	*ppte = (Pte*)0;
-
-	printf(" va = %x, %d, %d\n", va, pdeIndex, pteIndex);
-	if((PTE_P & pgdir[pdeIndex]))
-	{
-	    Pte* ptes = (Pte*)KADDR(PTE_ADDR(pgdir[pdeIndex]));
-
-	    Pte* resPte = ptes + pteIndex;
-
-	    if(PTE_P & *resPte)
-	    	*ppte = resPte;
-
-	}
-	else if(create)
-	{
-	    struct Page* page;
-	    ret = page_alloc(&page);
-
-	    if(ret != -E_NO_MEM)
-	    {
-	    	    page->pp_ref++;
-
-	    	    pgdir[pdeIndex] = page2pa(page) | PTE_P;
-	       	    //Pte* ptes = (Pte*)KADDR(PTE_ADDR(pgdir[pdeIndex])); 
-
-		    *ppte = NULL;
-
-		    //*ppte = ptes[pteIndex];
-	    }
+	if ((*pp = page_high_take()) != 0)
+		return 0;
+	return page_alloc(pp);
+}
 
-	}
+//
+// page_alloc_user, but the page is filled with zeros.
+//
+int
+page_alloc_user_zeroed(struct Page **pp)
+{
+	void *va;
 
-	return ret;
+	if ((*pp = page_high_take()) == 0)
+		return page_alloc_zeroed(pp);
+	va = page_kmap(*pp);
+	memset(va, 0, BY2PG);
+	page_kunmap(va);
+	return 0;
 }
 
 //
-// Map the physical page 'pp' at virtual address 'va'.
-// The permissions (the low 12 bits) of the page table
-//  entry should be set to 'perm|PTE_P'.
+// A kernel address for pp until the matching page_kunmap().
+// Highmem pages take one of KMAP_NSLOT slots, and the calls must nest:
+// unmap in the opposite order.
 //
-// Details
-//   - If there is already a page mapped at 'va', it is page_remove()d.
-//   - If necesary, on demand, allocates a page table and inserts it into 'pgdir'.
-//   - pp->pp_ref should be incremented if the insertion succeeds
+void *
+page_kmap(struct Page *pp)
+{
+	u_long va;
+
+	if (page2ppn(pp) < npage)
+		return (void *)page2kva(pp);
+	assert(kmap_depth < KMAP_NSLOT);
+	va = KMAPBASE + kmap_depth * BY2PG;
+	kmap_pte[kmap_depth++] = page2pte(pp) | PTE_W | PTE_P;
+	invlpg(va);
+	return (void *)va;
+}
+
+void
+page_kunmap(void *va)
+{
+	if ((u_long)va >= KERNBASE)
+		return;
+	assert(kmap_depth > 0
+	       && (u_long)va == KMAPBASE + (kmap_depth - 1) * BY2PG);
+	// the next page_kmap() of the slot flushes its TLB entry
+	kmap_pte[--kmap_depth] = 0;
+}
+#endif
+
 //
-// RETURNS: 
-//   0 on success
-//   -E_NO_MEM, if page table couldn't be allocated
+// Allocates 2^order physically contiguous pages, aligned on a
+// 2^order page boundary.  *pp is set to the Page struct of the first
+// page; the block must be returned with page_free_order(*pp, order).
+// As with page_alloc, the pages are not cleared and pp_ref is not
+// incremented.
 //
-// Hint: The TA solution is implemented using
-//   pgdir_walk() and and page_remove().
+// RETURNS
+//   0 -- on success
+//   -E_INVAL -- if order is out of range
+//   -E_NO_MEM -- if there is no free block that big
 //
 int
-page_insert(Pde *pgdir, struct Page *pp, u_long va, u_int perm) 
+page_alloc_order(int order, struct Page **pp)
 {
-	// Fill this function in
-	
-	Pte* pte = NULL;
-	int pdeIndex = PDX(va);
-	int pteIndex = PTX(va);
-	
-	if(pgdir_walk(pgdir, va, 1, &pte) == 0)
-	{
-		pp->pp_ref++;
-
-		if(pte != NULL)
-		{
-		    printf("hhhhhhhhhhhhhhhhhhh:%x, %d, %d\n", *pte, pdeIndex, pteIndex);
-		    page_remove(pgdir, va);
-		}
-		else
-		{
-		   pte = ((Pte*)KADDR(PTE_ADDR(pgdir[pdeIndex]))) + pteIndex;
-		}
+	struct Page *p;
+	int o;
+
+	if (order < 0 || order > PAGE_MAXORDER)
+		return -E_INVAL;
+
+	// find the smallest free block that is big enough,
+	// carving more out of the unused ranges if there is none
+	for (;;) {
+		for (o = order; o <= PAGE_MAXORDER; o++)
+			if (!LIST_EMPTY(&page_free_lists[o]))
+				break;
+		if (o <= PAGE_MAXORDER)
+			break;
+		if (page_carve(order) < 0)
+			return -E_NO_MEM;
+	}
 
+	p = LIST_FIRST(&page_free_lists[o]);
+	LIST_REMOVE(p, pp_link);
+	p->pp_free = 0;
 
-		Pte paAddr = page2pa(pp) | perm | PTE_P;
-		*pte = paAddr;
-		printf("stored entry addr=%x, %d, %d\n", PTE_ADDR(*pte), pdeIndex, pteIndex);
-	}
-	else
-	{
-		return -E_NO_MEM;
+	// split it, returning the upper halves to the free lists
+	while (o > order) {
+		o--;
+		buddy_insert(p + (1 << o), o);
 	}
+	p->pp_order = order;
+	p->pp_flags = 0;
 
+	*pp = p;
 	return 0;
 }
 
 //
-// Return the page mapped at virtual address 'va'.
-// If ppte is not zero, then we store in it the address
-// of the pte for this page.  This is used by page_remove
-// but should not be used by other callers.
-//
+// Return a page to the free list.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free(struct Page *pp)
+{
+#ifdef PAE
+	if (page2ppn(pp) >= npage) {
+		assert(!pp->pp_free);
+		pp->pp_free = 1;
+		LIST_INSERT_HEAD(&page_high_list, pp, pp_link);
+		return;
+	}
+#endif
+	page_free_order(pp, 0);
+}
+
+//
+// Return the block of 2^order pages headed by pp to the free lists,
+// merging it with its buddy for as long as the buddy is free too.
+// Each step is O(1), so a free costs at most PAGE_MAXORDER merges.
+//
+void
+page_free_order(struct Page *pp, int order)
+{
+	u_long ppn = page2ppn(pp), bppn;
+	struct Page *buddy;
+
+	assert(!pp->pp_free);
+
+	while (order < PAGE_MAXORDER) {
+		bppn = ppn ^ (1 << order);
+		if (bppn + (1 << order) > npage)
+			break;
+		buddy = &pages[bppn];
+		if (!buddy->pp_free || buddy->pp_order != order)
+			break;
+
+		LIST_REMOVE(buddy, pp_link);
+		buddy->pp_free = 0;
+		ppn &= ~(1 << order);
+		order++;
+	}
+
+	buddy_insert(&pages[ppn], order);
+}
+
+//
+// Count the free blocks of each order into nblocks[] (if non-null).
+// Memory not yet carved out of the free ranges is counted as the
+// blocks page_carve() would make of it.
+// Returns the total number of free pages.
+//
+u_long
+page_free_stats(u_long nblocks[PAGE_MAXORDER + 1])
+{
+	struct Page *pp;
+	u_long n, s, nfree = 0;
+	int i, o;
+
+	for (o = 0; o <= PAGE_MAXORDER; o++) {
+		n = 0;
+		LIST_FOREACH(pp, &page_free_lists[o], pp_link)
+			n++;
+		if (nblocks)
+			nblocks[o] = n;
+		nfree += n << o;
+	}
+
+	for (i = 0; i < page_nranges; i++) {
+		for (s = page_ranges[i].pr_start; s < page_ranges[i].pr_end;
+		     s += 1 << o) {
+			o = page_range_order(s, page_ranges[i].pr_end);
+			if (nblocks)
+				nblocks[o]++;
+			nfree += 1 << o;
+		}
+	}
+	return nfree;
+}
+
+//
+// The Page of the page table that pte lives in.
+//
+struct Page *
+pte2table(Pte *pte)
+{
+	return pa2page(PADDR(ROUNDDOWN(pte, BY2PG)));
+}
+
+//
+// Allocate an empty page table.  Unlike page_alloc, the reference
+// held by the page directory entry it is about to be installed in is
+// already counted (pp_ref == 1).
+//
+int
+page_table_alloc(struct Page **pp)
+{
+	int r;
+
+	if ((r = page_alloc_zeroed(pp)) < 0)
+		return r;
+	(*pp)->pp_ref = 1;
+	(*pp)->pp_ptes = 0;
+	(*pp)->pp_ptmap = 0;
+	pt_alloced++;
+	return 0;
+}
+
+//
+// Install page table pp at entry pdx of pgdir.  The PTEs carry the
+// real permissions.  User page tables are counted in the page
+// directory's summary, so that env_free can find them quickly.
+//
+void
+page_table_insert(Pde *pgdir, u_int pdx, struct Page *pp)
+{
+	struct Page *pgpp;
+
+	pgdir[pdx] = page2pa(pp) | PTE_U | PTE_W | PTE_P;
+	if (pdx < PDX(UTOP)) {
+		pgpp = pa2page(PADDR(pgdir));
+		pgpp->pp_ptes++;
+		pgpp->pp_ptmap |= 1 << (pdx / PGDIR_CHUNK);
+	}
+}
+
+//
+// Clear entry pdx of pgdir and drop its reference to the page table
+// there, freeing the table once nothing else refers to it.
+// The PTEs are left alone; the caller must have unmapped them, or
+// dropped the references they held.
+//
+void
+page_table_free(Pde *pgdir, u_int pdx)
+{
+	struct Page *pp = pa2page(PTE_ADDR(pgdir[pdx]));
+
+	pgdir[pdx] = 0;
+	if (pdx < PDX(UTOP))
+		pa2page(PADDR(pgdir))->pp_ptes--;
+	if (--pp->pp_ref == 0) {
+		pt_alloced--;
+		page_free(pp);
+	}
+}
+
+//
+// The next page directory, from envs[*pi] on, whose entry pdx refers
+// to the same page table as pgdir's, or 0 if there are no more.
+// Start with *pi at 0; it is left just past the one returned.
+//
+Pde *
+page_table_sharer(Pde *pgdir, u_int pdx, u_int *pi)
+{
+	Pde *other;
+
+	for (; *pi < nenv; (*pi)++) {
+		other = envs[*pi].env_pgdir;
+		if (other != 0 && other != pgdir && (other[pdx] & PTE_P)
+		    && PTE_ADDR(other[pdx]) == PTE_ADDR(pgdir[pdx])) {
+			(*pi)++;
+			return other;
+		}
+	}
+	return 0;
+}
+
+//
+// pgdir is about to let go of the page table at pdx, which other page
+// directories still share.  Hand the reverse mappings of the table's
+// pages that are recorded under pgdir to one of them.  Finding one
+// means a search of envs, so it is done only if there is a record to
+// move.
+//
+void
+page_table_disown(Pde *pgdir, u_int pdx)
+{
+	Pte *pt = (Pte *)KADDR(PTE_ADDR(pgdir[pdx]));
+	Pde *other = 0;
+	struct Rmap *rm;
+	u_int ptx, n, i = 0;
+	u_long va;
+
+	n = pa2page(PTE_ADDR(pgdir[pdx]))->pp_ptes;
+	for (ptx = 0; ptx < PTE2PT && n > 0; ptx++) {
+		if (!(pt[ptx] & (PTE_P | PTE_SWAPPED)))
+			continue;
+		n--;
+		if (!(pt[ptx] & PTE_P))
+			continue;
+		va = pdx * PDMAP + ptx * BY2PG;
+		rm = rmap_find(pte2page(pt[ptx]), pgdir, va);
+		if (rm == 0)
+			continue;
+		if (other == 0
+		    && (other = page_table_sharer(pgdir, pdx, &i)) == 0)
+			panic("page_table_disown: table %08lx at %d of %08lx "
+				"not shared", PTE_ADDR(pgdir[pdx]), pdx,
+				PADDR(pgdir));
+		rm->rm_pgdir = other;
+	}
+}
+
+//
+// Give pgdir a page table of its own at pdx in place of the one it
+// has shared since a fork (see pgdir_share_cow()).  Both tables then
+// map the same pages, so the writable ones become copy-on-write in
+// both.  A table that nothing else shares any more is just made
+// writable again.
+//
+// RETURNS
+//   1 if the table was shared and now is not
+//   0 if it was not shared
+//   -E_NO_MEM, if there is no memory for the copy; nothing is lost
+//
+int
+page_table_unshare(Pde *pgdir, u_int pdx)
+{
+	struct Page *opt, *npt, *pp;
+	Pte *spt, *dpt;
+	u_int ptx, n;
+	u_long va;
+	int r;
+
+	if (pdx >= PDX(UTOP) || (pgdir[pdx] & (PTE_P | PTE_W)) != PTE_P)
+		return 0;
+	opt = pa2page(PTE_ADDR(pgdir[pdx]));
+	if (opt->pp_ref == 1) {
+		pgdir[pdx] |= PTE_W;
+		goto flush;
+	}
+
+	// Allocating may swap out pages of the table, so do it first.
+	// It may also reap destroyed envs that shared the table, and
+	// leave pgdir the only one.
+	if ((r = page_table_alloc(&npt)) < 0)
+		return r;
+	if (opt->pp_ref == 1) {
+		npt->pp_ref = 0;
+		pt_alloced--;
+		page_free(npt);
+		pgdir[pdx] |= PTE_W;
+		goto flush;
+	}
+	spt = (Pte *)KADDR(PTE_ADDR(pgdir[pdx]));
+	dpt = (Pte *)page2kva(npt);
+
+	// Copy the entries.  Each page gets the copy's reference and one
+	// more that keeps it where it is until the records are made.
+	n = opt->pp_ptes;
+	for (ptx = 0; ptx < PTE2PT && n > 0; ptx++) {
+		if (!(spt[ptx] & (PTE_P | PTE_SWAPPED)))
+			continue;
+		n--;
+		if (spt[ptx] & PTE_P)
+			pte2page(spt[ptx])->pp_ref += 2;
+		else
+			swap_dup(SWAP_SLOT(spt[ptx]));
+		if ((spt[ptx] & PTE_W) && !(spt[ptx] & PTE_LIBRARY))
+			spt[ptx] = (spt[ptx] & ~PTE_W) | PTE_COW;
+		dpt[ptx] = spt[ptx];
+	}
+	npt->pp_ptes = opt->pp_ptes;
+
+	// The records under pgdir are the copy's from now on; the ones
+	// it kept for the others go to one of them.  Until pgdir points
+	// at the copy, reaping that one would hand them straight back,
+	// so making the records must not reap.
+	page_table_disown(pgdir, pdx);
+	pt_unsharing++;
+	for (ptx = 0, r = 0; ptx < PTE2PT && r == 0; ptx++)
+		if (dpt[ptx] & PTE_P)
+			r = rmap_add(pte2page(dpt[ptx]), pgdir,
+				pdx * PDMAP + ptx * BY2PG);
+	pt_unsharing--;
+
+	if (r < 0) {
+		// ptx is one past the entry that failed
+		for (n = 0; n < PTE2PT; n++) {
+			va = pdx * PDMAP + n * BY2PG;
+			if (dpt[n] & PTE_P) {
+				pp = pte2page(dpt[n]);
+				if (n + 1 < ptx)
+					rmap_remove(pp, pgdir, va);
+				pp->pp_ref -= 2;
+			} else if (dpt[n] & PTE_SWAPPED)
+				swap_free(SWAP_SLOT(dpt[n]));
+		}
+		npt->pp_ref = 0;
+		pt_alloced--;
+		page_free(npt);
+		return r;
+	}
+
+	opt->pp_ref--;
+	pgdir[pdx] = page2pa(npt) | PTE_U | PTE_W | PTE_P;
+	for (ptx = 0; ptx < PTE2PT; ptx++)
+		if (dpt[ptx] & PTE_P)
+			pte2page(dpt[ptx])->pp_ref--;
+	pt_copied++;
+
+flush:
+	// The TLB may hold the table's entries read-only.
+	if (curenv && curenv->env_pgdir == pgdir)
+		tlbflush();
+	return 1;
+}
+
+//
+// Get pgdir's page at va ready to be mapped again, or checked, with
+// perm.  The pages of a page table shared since a fork (see
+// pgdir_share_cow()) are read-only to every sharer, so if perm has
+// PTE_W, pgdir first gets its own copy of the table.  System calls
+// that hand out or check mappings of existing pages go through here.
+//
+// RETURNS
+//   as page_table_unshare(): 1 if the table changed, 0 if it did
+//   not, or -E_NO_MEM
+//
+int
+page_table_own(Pde *pgdir, u_long va, u_int perm)
+{
+	if (!(perm & PTE_W))
+		return 0;
+	return page_table_unshare(pgdir, PDX(va));
+}
+
+//
+// Number of page-table pages built at boot, and allocated since;
+// and of those shared at fork, and copied when written after.
+//
+void
+page_table_stats(u_long *nboot, u_long *nalloced, u_long *nshared,
+	u_long *ncopied)
+{
+	*nboot = pt_boot;
+	*nalloced = pt_alloced;
+	*nshared = pt_shared;
+	*ncopied = pt_copied;
+}
+
+//
+// Allocate an empty page directory.  Sets *ppgdir to its kernel
+// virtual address and *pcr3 to the value to load into CR3.
+// With PAE the directory is four contiguous pages and CR3 points at
+// a separate PDPT, so the two differ.
+//
+// RETURNS
+//   0 on success
+//   -E_NO_MEM, if there is no memory
+//
+int
+pgdir_alloc(Pde **ppgdir, u_int *pcr3)
+{
+	struct Page *pp;
+	int r;
+#ifdef PAE
+	Pde *pdpt;
+	int i;
+
+	if ((r = page_alloc_order(2, &pp)) < 0)
+		return r;
+	if ((pdpt = kmalloc(PDPTE2PDPT * sizeof(Pde))) == 0) {
+		page_free_order(pp, 2);
+		return -E_NO_MEM;
+	}
+	pp->pp_ref = 1;
+	pp->pp_ptes = 0;
+	pp->pp_ptmap = 0;
+	memset((void *)page2kva(pp), 0, PDE2PD * sizeof(Pde));
+	for (i = 0; i < PDPTE2PDPT; i++)
+		pdpt[i] = (page2pa(pp) + i * BY2PG) | PTE_P;
+	*pcr3 = PADDR(pdpt);
+#else
+	if ((r = page_alloc_zeroed(&pp)) < 0)
+		return r;
+	pp->pp_ref = 1;
+	pp->pp_ptes = 0;
+	pp->pp_ptmap = 0;
+	*pcr3 = page2pa(pp);
+#endif
+	*ppgdir = (Pde *)page2kva(pp);
+	return 0;
+}
+
+//
+// Free a page directory from pgdir_alloc.  Its user part must
+// already be empty.
+//
+void
+pgdir_free(Pde *pgdir, u_int cr3)
+{
+	struct Page *pp = pa2page(PADDR(pgdir));
+
+	pp->pp_ref = 0;
+#ifdef PAE
+	kfree((void *)KADDR(cr3));
+	page_free_order(pp, 2);
+#else
+	page_free(pp);
+#endif
+}
+
+//
+// Decrement the reference count on a page, freeing it if there are no more refs.
+//
+void
+page_decref(struct Page *pp)
+{
+	if (--pp->pp_ref == 0)
+		page_free(pp);
+}
+
+//
+// This is boot_pgdir_walk with a different allocate function.
+// Unlike boot_pgdir_walk, pgdir_walk can fail, so we have to
+// return pte via a pointer parameter.
+//
+// Stores address of page table entry in *ppte.
+// Stores 0 if there is no such entry or on error.
+// Callers that pass create are about to change the entry, so a page
+// table shared since fork is copied for pgdir first.
+// 
+// RETURNS: 
+//   0 on success
+//   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if va lies in a 4MB superpage
+//
+int
+pgdir_walk(Pde *pgdir, u_long va, int create, Pte **ppte)
+{
+	Pde *pde = &pgdir[PDX(va)];
+	struct Page *pp;
+	int r;
+
+	*ppte = 0;
+
+	// superpages only map the kernel window, which has no PTEs
+	if (*pde & PTE_PS)
+		return -E_INVAL;
+
+	if (!(*pde & PTE_P)) {
+		if (!create)
+			return 0;
+
+		if ((r = page_table_alloc(&pp)) < 0)
+			return r;
+		page_table_insert(pgdir, PDX(va), pp);
+	} else if (create && (r = page_table_unshare(pgdir, PDX(va))) < 0)
+		return r;
+
+	*ppte = (Pte *)KADDR(PTE_ADDR(*pde)) + PTX(va);
+	return 0;
+}
+
+//
+// Map the physical page 'pp' at virtual address 'va'.
+// The permissions (the low 12 bits) of the page table
+//  entry should be set to 'perm|PTE_P'.
+//
+// Details
+//   - If there is already a page mapped at 'va', it is page_remove()d.
+//   - If necesary, on demand, allocates a page table and inserts it into 'pgdir'.
+//   - pp->pp_ref should be incremented if the insertion succeeds
+//
+// RETURNS: 
+//   0 on success
+//   -E_NO_MEM, if page table couldn't be allocated
+//
+// Hint: The TA solution is implemented using
+//   pgdir_walk() and and page_remove().
+//
+int
+page_insert(Pde *pgdir, struct Page *pp, u_long va, u_int perm) 
+{
+	Pte *pte;
+	int r;
+
+	if ((r = pgdir_walk(pgdir, va, 1, &pte)) < 0)
+		return r;
+
+	return pte_insert(pgdir, pte, pp, va, perm);
+}
+
+//
+// The second half of page_insert: map pp at va through pte, the
+// entry for va that the caller looked up in pgdir.
+// Fails, with nothing changed, only if there is no memory to record
+// the reverse mapping.
+//
+static int
+pte_insert(Pde *pgdir, Pte *pte, struct Page *pp, u_long va, u_int perm)
+{
+	struct Page *old;
+	int r;
+
+	// Take the new reference first, so that re-inserting the page
+	// that is already mapped at va doesn't free it, and recording
+	// the mapping can't swap it out.  That may swap out what *pte
+	// maps, though, so look at *pte only after.
+	pp->pp_ref++;
+	if ((r = rmap_add(pp, pgdir, va)) < 0) {
+		pp->pp_ref--;
+		return r;
+	}
+	if (*pte & PTE_P) {
+		// replacing a mapping leaves the table's count alone
+		old = pte2page(*pte);
+		rmap_remove(old, pgdir, va);
+		page_decref(old);
+		*pte = page2pte(pp) | perm | PTE_P;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if (PTE_ISSWAPPED(*pte)) {
+		// so does replacing one that is swapped out
+		swap_free(SWAP_SLOT(*pte));
+		*pte = page2pte(pp) | perm | PTE_P;
+		return 0;
+	}
+
+	if (va < UTOP)
+		pte2table(pte)->pp_ptes++;
+	*pte = page2pte(pp) | perm | PTE_P;
+	return 0;
+}
+
+//
+// Return the page mapped at virtual address 'va'.
+// If ppte is not zero, then we store in it the address
+// of the pte for this page.  This is used by page_remove
+// but should not be used by other callers.
+//
 // Return 0 if there is no page mapped at va.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
@@ -763,14 +1666,15 @@ page_insert(Pde *pgdir, struct Page *pp, u_long va, u_int perm)
 struct Page*
 page_lookup(Pde *pgdir, u_long va, Pte **ppte)
 {
-	// Fill this function in
-	pgdir_walk(pgdir, va, 0, ppte);
+	Pte *pte;
 
-
-	if(*ppte == 0)
+	pgdir_walk(pgdir, va, 0, &pte);
+	if (pte == 0 || !(*pte & PTE_P))
 		return 0;
-	else
-		return (struct Page*)pa2page(PTE_ADDR(**ppte));
+
+	if (ppte)
+		*ppte = pte;
+	return pte2page(*pte);
 }
 
 //
@@ -787,45 +1691,568 @@ page_lookup(Pde *pgdir, u_long va, Pte **ppte)
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
 //
-void
+// RETURNS
+//   0 on success
+//   -E_NO_MEM, if va's page table is shared since fork and there is
+//     no memory to copy it
+//
+int
 page_remove(Pde *pgdir, u_long va) 
 {
-	// Fill this function in
-	
 	Pte* pte;
-	struct Page* page = page_lookup(pgdir, va, &pte);
+	int r;
 
-	if( page == NULL)
-		return;
+	// a swapped-out page is unmapped as well, by freeing its slot
+	pgdir_walk(pgdir, va, 0, &pte);
+	if (pte == NULL || !(*pte & (PTE_P | PTE_SWAPPED)))
+		return 0;
 
-	page->pp_ref--;
+	if ((r = pgdir_walk(pgdir, va, 1, &pte)) < 0)
+		return r;
+	pte_remove(pgdir, pte, va);
+	return 0;
+}
 
-	if(page->pp_ref== 0)
-	{
-		LIST_INSERT_HEAD(&page_free_list, page, pp_link);
-	}
+//
+// The second half of page_remove: unmap va, whose present or
+// swapped-out entry pte the caller looked up in pgdir.
+// Returns 1 if that freed the page table pte was in, 0 if not.
+//
+static int
+pte_remove(Pde *pgdir, Pte *pte, u_long va)
+{
+	struct Page *pp;
+
+	if (*pte & PTE_P) {
+		pp = pte2page(*pte);
+		rmap_remove(pp, pgdir, va);
+		page_decref(pp);
+	} else
+		swap_free(SWAP_SLOT(*pte));
 
 	*pte = 0;
 	tlb_invalidate(pgdir, va);
+
+	// a user page table goes as soon as its last entry does
+	if (va < UTOP && --pte2table(pte)->pp_ptes == 0) {
+		page_table_free(pgdir, PDX(va));
+		return 1;
+	}
+	return 0;
+}
+
+//
+// Map n freshly zeroed pages at va, va+BY2PG, ... in pgdir with
+// permission perm, as n page_insert calls would, but walking pgdir
+// only once per page table.
+//
+// RETURNS
+//   the number of pages mapped, which is less than n only if memory
+//     ran out
+//   -E_NO_MEM, if not even the first page could be mapped
+//
+int
+page_alloc_range(Pde *pgdir, u_long va, u_int n, u_int perm)
+{
+	struct Page *pp;
+	Pte *pt = 0;
+	u_int i;
+	int r = 0;
+
+	tlb_batch_begin(pgdir);
+	for (i = 0; i < n; i++, va += BY2PG) {
+		if (pt == 0 || PTX(va) == 0) {
+			if ((r = pgdir_walk(pgdir, va, 1, &pt)) < 0)
+				break;
+			pt -= PTX(va);
+		}
+		if ((r = page_alloc_user_zeroed(&pp)) < 0)
+			break;
+		if ((r = pte_insert(pgdir, pt + PTX(va), pp, va, perm)) < 0) {
+			page_free(pp);
+			break;
+		}
+	}
+	tlb_batch_flush();
+	return i > 0 ? i : r;
+}
+
+//
+// Map the pages described by the n entries of mv from src into dst,
+// as n page_insert calls would, walking each page directory again
+// only when an entry moves to a different page table.
+// mv is a kernel copy of the descriptors, already checked by the
+// caller.  Stops at the first entry whose source page is not mapped,
+// or not writable when mv_perm asks for PTE_W.
+//
+// RETURNS
+//   the number of entries mapped
+//   -E_INVAL or -E_NO_MEM, if the first entry could not be mapped
+//
+int
+page_map_vec(Pde *src, Pde *dst, const struct Mem_mapvec *mv, u_int n)
+{
+	struct Mem_mapvec v;
+	struct Page *pp;
+	Pte *spt = 0, *dpt = 0, *spte;
+	u_int i, spdx = 0, dpdx = 0;
+	int r = 0;
+
+	tlb_batch_begin(dst);
+	for (i = 0; i < n; i++) {
+		v = mv[i];
+		if ((r = page_table_own(src, v.mv_srcva, v.mv_perm)) < 0)
+			break;
+		if (r > 0)
+			spt = 0;
+		if (spt == 0 || PDX(v.mv_srcva) != spdx) {
+			pgdir_walk(src, v.mv_srcva, 0, &spt);
+			if (spt == 0) {
+				r = -E_INVAL;
+				break;
+			}
+			spt -= PTX(v.mv_srcva);
+			spdx = PDX(v.mv_srcva);
+		}
+		spte = spt + PTX(v.mv_srcva);
+		if (!(*spte & PTE_P)
+		    || ((v.mv_perm & PTE_W) && !(*spte & PTE_W))) {
+			r = -E_INVAL;
+			break;
+		}
+
+		// hold the page: allocating a page table could swap it out
+		pp = pte2page(*spte);
+		pp->pp_ref++;
+		if (dpt == 0 || PDX(v.mv_dstva) != dpdx) {
+			if ((r = pgdir_walk(dst, v.mv_dstva, 1, &dpt)) < 0) {
+				page_decref(pp);
+				break;
+			}
+			dpt -= PTX(v.mv_dstva);
+			dpdx = PDX(v.mv_dstva);
+			// that may have copied the table spt points into
+			if (src == dst)
+				spt = 0;
+		}
+		r = pte_insert(dst, dpt + PTX(v.mv_dstva), pp, v.mv_dstva,
+			v.mv_perm);
+		page_decref(pp);
+		if (r < 0)
+			break;
+	}
+	tlb_batch_flush();
+	return i > 0 ? i : r;
+}
+
+//
+// Unmap the n pages at va, va+BY2PG, ... of pgdir, as n page_remove
+// calls would, skipping page tables that are not there.  A page
+// table shared since fork that the range covers whole is just let go
+// of, rather than copied and emptied.
+//
+// RETURNS
+//   the number of pages unmapped, which is less than n only if memory
+//     ran out
+//   -E_NO_MEM, if not even the first page could be unmapped
+//
+int
+page_remove_range(Pde *pgdir, u_long va, u_int n)
+{
+	Pte *pt = 0;
+	u_int i, skip;
+	int r = 0;
+
+	tlb_batch_begin(pgdir);
+	for (i = 0; i < n; i++, va += BY2PG) {
+		if (pt == 0 || PTX(va) == 0) {
+			pgdir_walk(pgdir, va, 0, &pt);
+			skip = PTE2PT - 1 - PTX(va);
+			if (pt != 0 && PTX(va) == 0 && n - i > skip
+			    && !(pgdir[PDX(va)] & PTE_W)
+			    && pa2page(PTE_ADDR(pgdir[PDX(va)]))->pp_ref > 1) {
+				page_table_disown(pgdir, PDX(va));
+				page_table_free(pgdir, PDX(va));
+				tlb_invalidate_range(pgdir, va, PDMAP);
+				pt = 0;
+			}
+			if (pt == 0) {
+				// nothing is mapped in the rest of this table
+				i += skip;
+				va += skip * BY2PG;
+				continue;
+			}
+			if ((r = pgdir_walk(pgdir, va, 1, &pt)) < 0)
+				break;
+			pt -= PTX(va);
+		}
+		if ((pt[PTX(va)] & (PTE_P | PTE_SWAPPED))
+		    && pte_remove(pgdir, pt + PTX(va), va))
+			pt = 0;	// the table went with its last entry
+	}
+	tlb_batch_flush();
+	return i > 0 ? i : r;
+}
+
+//
+// Check that environment e may access [va, va+len) with permission
+// perm: the range must lie below ULIM and every page of it must be
+// mapped in e's page directory with perm|PTE_U|PTE_P.  Pages of e's
+// regions that are not there yet are filled in first, and swapped-out
+// pages read back in.
+//
+// RETURNS
+//   0 if so
+//   -E_INVAL, if not
+//   -E_NO_MEM, if a page table shared since fork could not be copied
+//     to make its pages writable, or a swapped-out page could not be
+//     read back in
+//
+int
+user_mem_check(struct Env *e, u_long va, u_long len, u_int perm)
+{
+	u_long end;
+	Pte *pte;
+	int r;
+
+	perm |= PTE_U | PTE_P;
+	end = va + len;
+	if (end < va || end > ULIM)
+		return -E_INVAL;
+	for (va = ROUNDDOWN(va, BY2PG); va < end; va += BY2PG) {
+		if (page_table_own(e->env_pgdir, va, perm) < 0)
+			return -E_NO_MEM;
+		pgdir_walk(e->env_pgdir, va, 0, &pte);
+		if (pte && PTE_ISSWAPPED(*pte)) {
+			// never fill a swapped-out page in afresh
+			if ((r = swap_in(e->env_pgdir, va)) < 0)
+				return r;
+			pgdir_walk(e->env_pgdir, va, 0, &pte);
+		} else if ((pte == 0 || !(*pte & PTE_P)) && va < UTOP
+		    && vma_fault(e, va, perm & PTE_W) == 0)
+			pgdir_walk(e->env_pgdir, va, 0, &pte);
+		if (pte == 0 || (*pte & perm) != perm)
+			return -E_INVAL;
+	}
+	return 0;
+}
+
+//
+// Share every user page table of src with dst, copy-on-write.
+// The tables are not copied: dst's page directory entries point at
+// src's, and both lose PTE_W, which makes every page in them
+// read-only.  The first write either side makes in a table, or any
+// change it makes to the table's mappings, copies it through
+// page_table_unshare(), and only then are its writable pages made
+// copy-on-write.  dst must have nothing mapped below UTOP.
+//
+void
+pgdir_share_cow(Pde *dst, Pde *src)
+{
+	struct Page *pgpp = pa2page(PADDR(src)), *pt;
+	u_int chunk, end, pdx;
+
+	assert(pa2page(PADDR(dst))->pp_ptes == 0);
+	for (chunk = 0; chunk < 32; chunk++) {
+		if (!(pgpp->pp_ptmap & (1 << chunk)))
+			continue;
+		end = MIN((chunk + 1) * PGDIR_CHUNK, (u_int)PDX(UTOP));
+		for (pdx = chunk * PGDIR_CHUNK; pdx < end; pdx++) {
+			if (!(src[pdx] & PTE_P))
+				continue;
+			pt = pa2page(PTE_ADDR(src[pdx]));
+			pt->pp_ref++;
+			page_table_insert(dst, pdx, pt);
+			dst[pdx] &= ~PTE_W;
+			src[pdx] &= ~PTE_W;
+			pt_shared++;
+		}
+	}
+
+	// src's pages were writable a moment ago
+	if (curenv && curenv->env_pgdir == src)
+		tlbflush();
+}
+
+//
+// Resolve a write fault at va on a copy-on-write page of pgdir by
+// giving pgdir its own writable copy of the page.  If nothing else
+// maps the page any more, it is simply made writable again.
+// A fault in a page table shared since fork copies the table first,
+// which may be all it takes.
+//
+// RETURNS
+//   0 on success
+//   -E_INVAL, if va is not mapped copy-on-write
+//   -E_NO_MEM, if there is no memory for the copy
+//
+int
+page_cow_fault(Pde *pgdir, u_long va)
+{
+	struct Page *pp, *np;
+	void *src, *dst;
+	Pte *pte;
+	u_int perm;
+	int r, unshared;
+
+	va = ROUNDDOWN(va, BY2PG);
+	if ((unshared = page_table_unshare(pgdir, PDX(va))) < 0)
+		return unshared;
+	if ((pp = page_lookup(pgdir, va, &pte)) == 0)
+		return -E_INVAL;
+	if (unshared && (*pte & PTE_W))
+		return 0;
+	if (!(*pte & PTE_COW))
+		return -E_INVAL;
+
+	if (pp->pp_ref == 1) {
+		*pte = (*pte & ~PTE_COW) | PTE_W;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	// hold pp: making room for the copy could swap it out
+	pp->pp_ref++;
+	if ((r = page_alloc_user(&np)) < 0) {
+		page_decref(pp);
+		return r;
+	}
+	dst = page_kmap(np);
+	src = page_kmap(pp);
+	memcpy(dst, src, BY2PG);
+	page_kunmap(src);
+	page_kunmap(dst);
+	perm = ((u_int)*pte & PTE_USER & ~PTE_COW) | PTE_W;
+	if ((r = page_insert(pgdir, np, va, perm)) < 0)
+		page_free(np);
+	page_decref(pp);
+	return r;
+}
+
+//
+// Move the clock hand h one step over the user PTEs of every live
+// environment, envs[0] to envs[nenv-1] and around again.  A step
+// looks at one PTE, or skips an unmapped page table or a whole env
+// that is free, dying, or not the env the hand entered at va 0.
+//
+// RETURNS
+//   PH_PTE, with *ppte and *va set to a present user PTE
+//   PH_SKIP, if there was no user PTE to look at
+//   PH_NEXT, if the hand left its env for the next one
+//   PH_LAP, if the hand left the last env for envs[0]
+//
+int
+pte_hand_step(struct Pte_hand *h, Pte **ppte, u_long *va)
+{
+	struct Env *e;
+	Pde pde;
+
+	if (h->ph_va >= UTOP) {
+		h->ph_va = 0;
+		if (++h->ph_env >= nenv) {
+			h->ph_env = 0;
+			return PH_LAP;
+		}
+		return PH_NEXT;
+	}
+
+	e = &envs[h->ph_env];
+	if (h->ph_va == 0)
+		h->ph_envid = e->env_id;
+	if (e->env_status == ENV_FREE || e->env_status == ENV_DYING
+	    || e->env_pgdir == 0 || e->env_id != h->ph_envid) {
+		h->ph_va = UTOP;
+		return PH_SKIP;
+	}
+	pde = e->env_pgdir[PDX(h->ph_va)];
+	if (!(pde & PTE_P) || (pde & PTE_PS)) {
+		h->ph_va = ROUNDDOWN(h->ph_va, PDMAP) + PDMAP;
+		return PH_SKIP;
+	}
+
+	*va = h->ph_va;
+	h->ph_va += BY2PG;
+	*ppte = (Pte *)KADDR(PTE_ADDR(pde)) + PTX(*va);
+	if ((**ppte & (PTE_P | PTE_U)) != (PTE_P | PTE_U))
+		return PH_SKIP;
+	return PH_PTE;
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// Mappings above UTOP are shared by every address space and may be
+// global, so those are always invalidated.
 //
 void
 tlb_invalidate(Pde *pgdir, u_long va)
 {
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	if (!(va >= UTOP || !curenv || curenv->env_pgdir == pgdir))
+		return;
+
+	if (tlb_batch.pgdir != pgdir) {
 		invlpg(va);
+		return;
+	}
+
+	if (va >= UTOP)
+		tlb_batch.global = 1;
+	if (tlb_batch.n < TLB_BATCH_MAX)
+		tlb_batch.va[tlb_batch.n++] = va;
+	else
+		tlb_batch.overflow = 1;
+}
+
+//
+// tlb_invalidate() after changing *pte, pgdir's entry for va, through
+// a reverse mapping.  A page table shared since fork is recorded under
+// only one of its sharers, which need not be the one running, so
+// invalidate va for curenv too if its page directory shares the table.
+//
+void
+tlb_invalidate_pte(Pde *pgdir, Pte *pte, u_long va)
+{
+	Pde *cur = curenv ? curenv->env_pgdir : 0;
+
+	if (cur != 0 && cur != pgdir && va < UTOP
+	    && pte2table(pte)->pp_ref > 1 && (cur[PDX(va)] & PTE_P)
+	    && PTE_ADDR(cur[PDX(va)]) == PADDR(ROUNDDOWN(pte, BY2PG)))
+		pgdir = cur;
+	tlb_invalidate(pgdir, va);
+}
+
+//
+// Start collecting the invalidations for pgdir instead of doing
+// them one at a time.  Batches do not nest.
+//
+void
+tlb_batch_begin(Pde *pgdir)
+{
+	assert(tlb_batch.pgdir == 0);
+	tlb_batch.pgdir = pgdir;
+	tlb_batch.n = 0;
+	tlb_batch.overflow = 0;
+	tlb_batch.global = 0;
+}
+
+//
+// Carry out the invalidations queued since tlb_batch_begin()
+// and end the batch.
+//
+void
+tlb_batch_flush(void)
+{
+	int i;
+
+	assert(tlb_batch.pgdir != 0);
+	if (tlb_batch.overflow) {
+		if (tlb_batch.global)
+			tlb_flush_global();
+		else
+			tlbflush();
+	} else {
+		for (i = 0; i < tlb_batch.n; i++)
+			invlpg(tlb_batch.va[i]);
+	}
+	tlb_batch.pgdir = 0;
+}
+
+//
+// Invalidate every page in [va, va+size) of pgdir.
+//
+void
+tlb_invalidate_range(Pde *pgdir, u_long va, u_long size)
+{
+	u_long off;
+
+	// an enclosing batch will do the flushing
+	if (tlb_batch.pgdir == pgdir) {
+		for (off = 0; off < size; off += BY2PG)
+			tlb_invalidate(pgdir, va + off);
+		return;
+	}
+
+	tlb_batch_begin(pgdir);
+	for (off = 0; off < size && !tlb_batch.overflow; off += BY2PG)
+		tlb_invalidate(pgdir, va + off);
+	tlb_batch_flush();
+}
+
+//
+// Flush the whole TLB, global entries included.
+// Reloading CR3 leaves global entries alone; toggling CR4_PGE
+// does not.
+//
+void
+tlb_flush_global(void)
+{
+	u_int cr4;
+
+	if (!pge_enabled) {
+		tlbflush();
+		return;
+	}
+	cr4 = rcr4();
+	lcr4(cr4 & ~CR4_PGE);
+	lcr4(cr4);
+}
+
+// Everything the allocator has free, set aside by page_free_steal.
+struct Page_saved {
+	struct Page_list ps_lists[PAGE_MAXORDER + 1];
+	struct Page_range ps_ranges[PAGE_NRANGES];
+	int ps_nranges;
+};
+
+//
+// Move every free block and range into saved, leaving the allocator
+// empty.  The blocks lose their pp_free marks so that nothing freed
+// in the meantime can merge with them.
+//
+static void
+page_free_steal(struct Page_saved *saved)
+{
+	struct Page *pp;
+	int o;
+
+	for (o = 0; o <= PAGE_MAXORDER; o++) {
+		saved->ps_lists[o] = page_free_lists[o];
+		LIST_INIT(&page_free_lists[o]);
+		LIST_FOREACH(pp, &saved->ps_lists[o], pp_link)
+			pp->pp_free = 0;
+	}
+	memcpy(saved->ps_ranges, page_ranges, sizeof(page_ranges));
+	saved->ps_nranges = page_nranges;
+	page_nranges = 0;
+}
+
+//
+// Undo page_free_steal.  The allocator must be empty.
+//
+static void
+page_free_restore(struct Page_saved *saved)
+{
+	struct Page *pp;
+	int o;
+
+	for (o = 0; o <= PAGE_MAXORDER; o++) {
+		assert(LIST_EMPTY(&page_free_lists[o]));
+		page_free_lists[o] = saved->ps_lists[o];
+		LIST_FOREACH(pp, &page_free_lists[o], pp_link)
+			pp->pp_free = 1;
+	}
+	assert(page_nranges == 0);
+	memcpy(page_ranges, saved->ps_ranges, sizeof(page_ranges));
+	page_nranges = saved->ps_nranges;
 }
 
 void
 page_check(void)
 {
 	struct Page *pp, *pp0, *pp1, *pp2;
-	struct Page_list fl;
+	struct Page_saved fl;
+	u_long nfree;
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -838,8 +2265,7 @@ page_check(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	page_free_steal(&fl);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -884,6 +2310,7 @@ page_check(void)
 	// ... and ref counts should reflect this
 	assert(pp1->pp_ref == 2);
 	assert(pp2->pp_ref == 0);
+	assert(pp0->pp_ptes == 2);
 
 	// pp2 should be returned by page_alloc
 	assert(page_alloc(&pp) == 0 && pp == pp2);
@@ -895,33 +2322,42 @@ page_check(void)
 	assert(pp1->pp_ref == 1);
 	assert(pp2->pp_ref == 0);
 
-	// unmapping pp1 at BY2PG should free it
+	// unmapping pp1 at BY2PG should free it,
+	// and the page table, which is now empty
+	assert(pp0->pp_ptes == 1);
 	page_remove(boot_pgdir, BY2PG);
 	assert(va2pa(boot_pgdir, 0x0) == ~0);
 	assert(va2pa(boot_pgdir, BY2PG) == ~0);
 	assert(pp1->pp_ref == 0);
 	assert(pp2->pp_ref == 0);
+	assert(boot_pgdir[0] == 0);
+	assert(pp0->pp_ref == 0);
 
-	// so it should be returned by page_alloc
-	assert(page_alloc(&pp) == 0 && pp == pp1);
+	// so both should be returned by page_alloc
+	assert(page_alloc(&pp) == 0 && (pp == pp0 || pp == pp1));
+	assert(page_alloc(&pp) == 0 && (pp == pp0 || pp == pp1));
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
 
-	// forcibly take pp0 back
-	assert(PTE_ADDR(boot_pgdir[0]) == page2pa(pp0));
-	boot_pgdir[0] = 0;
-	assert(pp0->pp_ref == 1);
-	pp0->pp_ref = 0;
-
 	// give free list back
-	page_free_list = fl;
+	page_free_restore(&fl);
 
 	// free the pages we took
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
 
+	// multi-page blocks should be aligned and contiguous,
+	// and should merge back with their buddies when freed
+	nfree = page_free_stats(0);
+	assert(page_alloc_order(3, &pp) == 0);
+	assert(page2ppn(pp) % 8 == 0 && pp->pp_order == 3);
+	assert(page_alloc_order(PAGE_MAXORDER + 1, &pp0) == -E_INVAL);
+	assert(page_free_stats(0) == nfree - 8);
+	page_free_order(pp, 3);
+	assert(page_free_stats(0) == nfree);
+
 	printf("page_check() succeeded!\n");
 }
 
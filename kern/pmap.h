@@ -43,24 +43,110 @@ extern char bootstacktop[], bootstack[];
 extern u_long npage;
 
 
+struct Mem_mapvec;
+struct Env;
+
 extern struct Segdesc gdt[];
 extern struct Pseudodesc gdt_pd;
 extern struct Page *pages;
 extern u_long npage;
+extern u_long nhighpage;
 extern u_long boot_cr3;
 extern Pde *boot_pgdir;
 
+// Largest block handed out by the buddy allocator: 2^10 pages = PDMAP.
+#define PAGE_MAXORDER	10
+
+// Target size of the pre-zeroed page pool, and how many pages
+// each idle pass clears into it.
+#define PAGE_ZERO_POOL	64
+#define PAGE_ZERO_BATCH	8
+
+// Nonzero to have page_init() just record the free memory ranges
+// and split them into buddy blocks as allocations need them; zero to
+// free every page one at a time during boot.
+#ifndef PAGE_LAZY_INIT
+#define PAGE_LAZY_INIT	1
+#endif
+
+// Page directory entries summarized by each bit of a page
+// directory's pp_ptmap.
+#define PGDIR_CHUNK	(PDE2PD / 32)
+
+// A TLB batch remembers up to this many pages; flushing more than
+// that reloads CR3 instead of issuing one invlpg per page.
+#define TLB_BATCH_MAX	32
+
+// A clock hand over every environment's user PTEs, for the scanners
+// that walk them a little at a time: swap_out(), ksm_scan() and
+// ws_tick().  All zeroes is the start of envs[0].
+struct Pte_hand {
+	u_int ph_env;		// envs[] index of the env it is in
+	u_int ph_envid;		// that env's env_id when the hand got there
+	u_long ph_va;		// the next va to look at
+};
+
+// What a pte_hand_step() did.
+#define PH_PTE		0	// found a present user PTE
+#define PH_SKIP		1	// passed over pages with no user PTE
+#define PH_NEXT		2	// moved on to the next env
+#define PH_LAP		3	// moved on to envs[0]: a lap is done
+
 void i386_vm_init();
 void i386_detect_memory();
+void *alloc(u_int n, u_int align, int clear);
 void page_init(void);
 void page_check(void);
 int  page_alloc(struct Page **);
 void page_free(struct Page *);
+int  page_alloc_zeroed(struct Page **);
+#ifdef PAE
+int  page_alloc_user(struct Page **);
+int  page_alloc_user_zeroed(struct Page **);
+void *page_kmap(struct Page *);
+void page_kunmap(void *);
+#else
+// Without PAE every page is in the KERNBASE window.
+#define page_alloc_user(pp)		page_alloc(pp)
+#define page_alloc_user_zeroed(pp)	page_alloc_zeroed(pp)
+#define page_kmap(pp)			((void *)page2kva(pp))
+#define page_kunmap(va)			((void)(va))
+#endif
+void page_zero_refill(int n);
+u_long page_zero_pooled(void);
+int  page_alloc_order(int order, struct Page **);
+void page_free_order(struct Page *, int order);
+u_long page_free_stats(u_long nblocks[PAGE_MAXORDER + 1]);
 int  page_insert(Pde *, struct Page *, u_long, u_int);
-void page_remove(Pde *, u_long va);
+int  page_remove(Pde *, u_long va);
 struct Page *page_lookup(Pde*, u_long, Pte**);
 void page_decref(struct Page*);
+int  page_alloc_range(Pde *, u_long va, u_int n, u_int perm);
+int  page_map_vec(Pde *src, Pde *dst, const struct Mem_mapvec *, u_int n);
+int  page_remove_range(Pde *, u_long va, u_int n);
+int  user_mem_check(struct Env *, u_long va, u_long len, u_int perm);
+void pgdir_share_cow(Pde *dst, Pde *src);
+int  page_cow_fault(Pde *, u_long va);
+int  page_table_alloc(struct Page **);
+void page_table_insert(Pde *, u_int pdx, struct Page *);
+void page_table_free(Pde *, u_int pdx);
+Pde *page_table_sharer(Pde *, u_int pdx, u_int *pi);
+void page_table_disown(Pde *, u_int pdx);
+int  page_table_unshare(Pde *, u_int pdx);
+int  page_table_own(Pde *, u_long va, u_int perm);
+void page_table_stats(u_long *nboot, u_long *nalloced, u_long *nshared,
+	u_long *ncopied);
+int  pgdir_alloc(Pde **, u_int *cr3);
+void pgdir_free(Pde *, u_int cr3);
+void pgdir_map_vpt(Pde *);
+int  pte_hand_step(struct Pte_hand *, Pte **, u_long *va);
+struct Page *pte2table(Pte *);
 void tlb_invalidate(Pde *, u_long va);
+void tlb_invalidate_pte(Pde *, Pte *, u_long va);
+void tlb_flush_global(void);
+void tlb_invalidate_range(Pde *, u_long va, u_long size);
+void tlb_batch_begin(Pde *);
+void tlb_batch_flush(void);
 
 static inline u_long
 page2ppn(struct Page *pp)
@@ -88,6 +174,23 @@ page2kva(struct Page *pp)
 	return KADDR(page2pa(pp));
 }
 
+// The page that user PTE pte maps, which with PAE may be in highmem:
+// pa2page(PTE_ADDR(pte)) only does for page tables.
+static inline struct Page *
+pte2page(Pte pte)
+{
+	if (PTE_PPN(pte) >= npage + nhighpage)
+		panic("pte2page called with invalid pte");
+	return &pages[PTE_PPN(pte)];
+}
+
+// The address bits of a PTE mapping pp.
+static inline Pte
+page2pte(struct Page *pp)
+{
+	return (Pte)page2ppn(pp) << PGSHIFT;
+}
+
 int pgdir_walk(Pde *pgdir, u_long va, int create, Pte **ppte);
 
 #endif /* _KERN_PMAP_H_ */
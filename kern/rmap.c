@@ -0,0 +1,149 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/rmap.h>
+
+static struct Kmem_cache *rmap_cache;	// where struct Rmaps come from
+
+//
+// Start tracking mappings.  Mappings made before this, by the boot
+// time checks in pmap.c, are not tracked, and must be gone by now.
+//
+void
+rmap_init(void)
+{
+	rmap_cache = kmem_cache_create("rmap", sizeof(struct Rmap),
+		sizeof(void *), 0);
+	if (rmap_cache == 0)
+		panic("rmap_init: out of memory");
+}
+
+//
+// Record that pgdir maps pp at va.
+// Mappings at or above UTOP are not tracked.
+//
+// RETURNS
+//   0 on success
+//   -E_NO_MEM, if there is no memory for the record
+//
+int
+rmap_add(struct Page *pp, Pde *pgdir, u_long va)
+{
+	struct Rmap *rm;
+
+	if (va >= UTOP || rmap_cache == 0)
+		return 0;
+	if ((rm = kmem_cache_alloc(rmap_cache)) == 0)
+		return -E_NO_MEM;
+	rm->rm_pgdir = pgdir;
+	rm->rm_va = va;
+	rm->rm_next = pp->pp_rmap;
+	pp->pp_rmap = rm;
+	return 0;
+}
+
+//
+// Forget that pgdir maps pp at va.
+//
+void
+rmap_remove(struct Page *pp, Pde *pgdir, u_long va)
+{
+	struct Rmap **prm, *rm;
+
+	if (va >= UTOP || rmap_cache == 0)
+		return;
+	for (prm = &pp->pp_rmap; (rm = *prm) != 0; prm = &rm->rm_next)
+		if (rm->rm_pgdir == pgdir && rm->rm_va == va) {
+			*prm = rm->rm_next;
+			kmem_cache_free(rmap_cache, rm);
+			return;
+		}
+	panic("rmap_remove: page %08lx not mapped at %08lx in %08lx",
+		page2pa(pp), va, PADDR(pgdir));
+}
+
+//
+// The record of pgdir mapping pp at va, or 0 if there is none.
+//
+struct Rmap *
+rmap_find(struct Page *pp, Pde *pgdir, u_long va)
+{
+	struct Rmap *rm;
+
+	RMAP_FOREACH(rm, pp)
+		if (rm->rm_pgdir == pgdir && rm->rm_va == va)
+			return rm;
+	return 0;
+}
+
+//
+// rm, a mapping of from, has been pointed at to instead: move its
+// record over.
+//
+void
+rmap_move(struct Page *from, struct Page *to, struct Rmap *rm)
+{
+	struct Rmap **prm;
+
+	for (prm = &from->pp_rmap; *prm != rm; prm = &(*prm)->rm_next)
+		assert(*prm != 0);
+	*prm = rm->rm_next;
+	rm->rm_next = to->pp_rmap;
+	to->pp_rmap = rm;
+}
+
+//
+// The PTE of mapping rm.
+//
+Pte *
+rmap_pte(struct Rmap *rm)
+{
+	Pte *pte;
+
+	pgdir_walk(rm->rm_pgdir, rm->rm_va, 0, &pte);
+	assert(pte && (*pte & PTE_P));
+	return pte;
+}
+
+//
+// Whether every mapping of pp could be pointed at another page with
+// the same contents, as swapping and page merging do.  Every
+// reference to pp must be a mapping we can find and rewrite, and
+// none of them PTE_LIBRARY.  A page that is shared must not be
+// writable through any of them, since they would not share the
+// copies.
+//
+int
+rmap_movable(struct Page *pp)
+{
+	struct Rmap *rm;
+	u_int n = 0, w = 0;
+	Pte *pte;
+
+	RMAP_FOREACH(rm, pp) {
+		pte = rmap_pte(rm);
+		if (*pte & PTE_LIBRARY)
+			return 0;
+		w |= *pte & PTE_W;
+		n++;
+	}
+	return n > 0 && n == pp->pp_ref && (n == 1 || !w);
+}
+
+//
+// Number of user mappings of pp.
+//
+u_int
+rmap_count(struct Page *pp)
+{
+	struct Rmap *rm;
+	u_int n = 0;
+
+	RMAP_FOREACH(rm, pp)
+		n++;
+	return n;
+}
@@ -0,0 +1,44 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef _KERN_RMAP_H_
+#define _KERN_RMAP_H_
+
+#include <inc/types.h>
+#include <inc/pmap.h>
+
+//
+// Reverse mappings: for each physical page, the (page directory,
+// virtual address) pairs that map it below UTOP.
+//
+// pte_insert() and pte_remove() keep the lists up to date, as does
+// everything else that fills in or clears user PTEs directly.  Each
+// mapping costs one 12-byte struct Rmap from the "rmap" slab cache;
+// the list is unordered and searched linearly on removal, which is
+// short for all but widely shared pages.
+//
+// A page table shared by several page directories since a fork (see
+// pgdir_share_cow()) has its mappings recorded once, under any one of
+// them; page_table_disown() moves the records when that one lets go.
+// To list every (env, va) that maps a page, follow each record with
+// page_table_sharer() for the other directories, as pagemap does.
+//
+
+struct Rmap {
+	Pde *rm_pgdir;			// page directory of the mapping
+	u_long rm_va;			// where it maps the page
+	struct Rmap *rm_next;		// next mapping of the same page
+};
+
+#define RMAP_FOREACH(rm, pp) \
+	for ((rm) = (pp)->pp_rmap; (rm) != 0; (rm) = (rm)->rm_next)
+
+void rmap_init(void);
+int  rmap_add(struct Page *, Pde *pgdir, u_long va);
+void rmap_remove(struct Page *, Pde *pgdir, u_long va);
+struct Rmap *rmap_find(struct Page *, Pde *pgdir, u_long va);
+void rmap_move(struct Page *from, struct Page *to, struct Rmap *);
+u_int rmap_count(struct Page *);
+Pte  *rmap_pte(struct Rmap *);
+int  rmap_movable(struct Page *);
+
+#endif /* !_KERN_RMAP_H_ */
@@ -1,23 +1,52 @@
-
 #include <inc/assert.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/ksm.h>
 
+//
+// Return the first runnable environment after 'after' in the envs
+// array, wrapping around and coming back to 'after' itself last.
+// envs[0], the idle environment, is never chosen.
+// Returns 0 if no environment is runnable.
+//
+struct Env *
+sched_next(struct Env *after)
+{
+	u_int i, k, start;
+
+	start = after ? after - envs : 0;
+	for (k = 1; k <= nenv; k++) {
+		i = start + k;
+		if (i >= nenv)
+			i -= nenv;
+		if (i != 0 && envs[i].env_status == ENV_RUNNABLE)
+			return &envs[i];
+	}
+	return 0;
+}
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	// Your code here to implement simple round-robin scheduling.
-	// Search through envs array for a runnable environment,
-	// in circular fashion starting from the previously running env,
-	// and switch to the first such environment found.
-	// But never choose envs[0], the idle environment,
-	// unless NOTHING else is runnable.
+	struct Env *e;
+
+	// Round-robin: search the envs array in circular fashion
+	// starting after the previously running env, and never choose
+	// envs[0], the idle environment, unless nothing else is runnable.
+	if ((e = sched_next(curenv)) != 0)
+		env_run(e);
 
 	// Run the special idle environment when nothing else is runnable.
+	// The CPU has nothing better to do, so free some of what destroyed
+	// environments left, clear some pages for page_alloc_zeroed() and
+	// look for user pages to merge first.
 	assert(envs[0].env_status == ENV_RUNNABLE);
+	env_reap(ENV_REAP_IDLE);
+	page_zero_refill(PAGE_ZERO_BATCH);
+	ksm_scan(KSM_BATCH);
 	env_run(&envs[0]);
 }
 
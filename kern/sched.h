@@ -3,6 +3,9 @@
 #ifndef __SCHED_H__
 #define __SCHED_H__
 
+struct Env;
+
 void sched_yield(void);
+struct Env *sched_next(struct Env *after);
 
 #endif /* __SCHED_H__ */
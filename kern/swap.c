@@ -0,0 +1,260 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/disk.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kmalloc.h>
+#include <kern/swap.h>
+#include <kern/rmap.h>
+
+#define SECTPERPG	(BY2PG / SECTSIZE)
+
+static u_short *swap_map;	// references to each slot, 0 if free
+static u_int swap_nslots;	// 0 if there is no swap disk
+static u_int swap_hint;		// no free slot below this one
+static struct Swap_stats stats;
+
+// The clock hand: the next PTE swap_out() looks at.
+static struct Pte_hand hand;
+
+//
+// Find the swap disk and set up the slot map.
+// Without a disk swap_out() always fails, and page_alloc with it.
+//
+void
+swap_init(void)
+{
+	swap_nslots = MIN(ide_nsectors(SWAP_DISK) / SECTPERPG, SWAP_MAXSLOTS);
+	if (swap_nslots == 0) {
+		printf("swap: no swap disk\n");
+		return;
+	}
+
+	if ((swap_map = kmalloc(swap_nslots * sizeof(swap_map[0]))) == 0)
+		panic("swap_init: out of memory");
+	memset(swap_map, 0, swap_nslots * sizeof(swap_map[0]));
+	stats.ss_nslots = swap_nslots;
+	printf("swap: %d slots (%dK) on disk %d\n", swap_nslots,
+		swap_nslots * (BY2PG / 1024), SWAP_DISK);
+}
+
+// Claim a free slot.  Returns it, or -E_NO_MEM if the disk is full.
+static int
+slot_alloc(void)
+{
+	u_int slot;
+
+	for (slot = swap_hint; slot < swap_nslots; slot++)
+		if (swap_map[slot] == 0) {
+			swap_map[slot] = 1;
+			swap_hint = slot + 1;
+			stats.ss_inuse++;
+			return slot;
+		}
+	swap_hint = swap_nslots;
+	return -E_NO_MEM;
+}
+
+//
+// Note another PTE naming slot, as when fork copies one.
+//
+void
+swap_dup(u_int slot)
+{
+	assert(slot < swap_nslots && swap_map[slot] > 0
+		&& swap_map[slot] < 0xFFFF);
+	swap_map[slot]++;
+}
+
+//
+// Drop a PTE's reference to slot, freeing it with the last one.
+//
+void
+swap_free(u_int slot)
+{
+	assert(slot < swap_nslots && swap_map[slot] > 0);
+	if (--swap_map[slot] == 0) {
+		stats.ss_inuse--;
+		swap_hint = MIN(swap_hint, slot);
+	}
+}
+
+//
+// Whether any mapping of pp has been accessed since the clock hand
+// last passed.  Clears the accessed bits for the next lap.
+//
+static int
+page_referenced(struct Page *pp)
+{
+	struct Rmap *rm;
+	Pte *pte;
+	int r = 0;
+
+	RMAP_FOREACH(rm, pp) {
+		pte = rmap_pte(rm);
+		if (*pte & PTE_A) {
+			*pte &= ~PTE_A;
+			tlb_invalidate_pte(rm->rm_pgdir, pte, rm->rm_va);
+			pp->pp_flags |= PG_WS_A;
+			r = 1;
+		}
+	}
+	if (pp->pp_flags & PG_SWAP_A) {
+		pp->pp_flags &= ~PG_SWAP_A;
+		r = 1;
+	}
+	return r;
+}
+
+//
+// Write pp out to swap, point every PTE that maps it at the slot,
+// and free it.
+//
+static int
+swap_evict(struct Page *pp)
+{
+	struct Rmap *rm;
+	u_int64_t t0;
+	u_int n = 0;
+	Pte *pte;
+	void *va;
+	int slot;
+
+	if ((slot = slot_alloc()) < 0)
+		return slot;
+
+	t0 = read_tsc();
+	va = page_kmap(pp);
+	if (ide_write(SWAP_DISK, slot * SECTPERPG, va, SECTPERPG) < 0)
+		panic("swap_out: disk error writing slot %d", slot);
+	page_kunmap(va);
+	stats.ss_cycles_out += read_tsc() - t0;
+	stats.ss_nout++;
+
+	while ((rm = pp->pp_rmap) != 0) {
+		pte = rmap_pte(rm);
+		*pte = SWAP_PTE(slot, *pte);
+		tlb_invalidate_pte(rm->rm_pgdir, pte, rm->rm_va);
+		rmap_remove(pp, rm->rm_pgdir, rm->rm_va);
+		page_decref(pp);
+		n++;
+	}
+	swap_map[slot] = n;
+	return 0;
+}
+
+//
+// Free a page by writing a user page out to swap.
+// The clock hand moves over every environment's user PTEs.  A page
+// that has been accessed through any of its mappings since the hand
+// last passed gets the accessed bits cleared and another lap to be
+// touched again; one that hasn't is evicted, if rmap_movable()
+// allows it and it is not in highmem.  All of its mappings then
+// share the slot.
+//
+// RETURNS
+//   0 on success, with a page freed
+//   -E_NO_MEM, if there is no swap disk or space on it, or two laps
+//     of the hand found nothing to evict
+//
+int
+swap_out(void)
+{
+	struct Page *pp;
+	Pte *pte;
+	u_long va;
+	u_int laps = 0;
+
+	if (swap_nslots == 0)
+		return -E_NO_MEM;
+
+	for (;;) {
+		switch (pte_hand_step(&hand, &pte, &va)) {
+		case PH_LAP:
+			if (++laps > 2)
+				return -E_NO_MEM;
+			break;
+		case PH_PTE:
+			pp = pte2page(*pte);
+			// page_alloc() wants memory it can hand out, and
+			// that never includes highmem
+			if (page2ppn(pp) < npage && rmap_movable(pp)
+			    && !page_referenced(pp))
+				return swap_evict(pp);
+			break;
+		}
+	}
+}
+
+//
+// Read the swapped-out page at va in pgdir back in and map it again.
+//
+// RETURNS
+//   0 on success
+//   -E_INVAL, if the page at va is not swapped out
+//   -E_NO_MEM, if there is no memory for it
+//
+int
+swap_in(Pde *pgdir, u_long va)
+{
+	struct Page *pp;
+	u_int64_t t0;
+	u_int slot;
+	void *kva;
+	Pte *pte;
+	int r;
+
+	va = ROUNDDOWN(va, BY2PG);
+	pgdir_walk(pgdir, va, 0, &pte);
+	if (pte == 0 || !PTE_ISSWAPPED(*pte))
+		return -E_INVAL;
+	// making room may swap other pages out and reap destroyed envs,
+	// but never frees a table a live env uses
+	if ((r = page_alloc_user(&pp)) < 0)
+		return r;
+
+	slot = SWAP_SLOT(*pte);
+	t0 = read_tsc();
+	kva = page_kmap(pp);
+	if (ide_read(SWAP_DISK, slot * SECTPERPG, kva, SECTPERPG) < 0)
+		panic("swap_in: disk error reading slot %d", slot);
+	page_kunmap(kva);
+	stats.ss_cycles_in += read_tsc() - t0;
+	stats.ss_nin++;
+
+	if ((r = rmap_add(pp, pgdir, va)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	pp->pp_ref = 1;
+	*pte = page2pte(pp) | (*pte & PTE_USER & ~PTE_SWAPPED) | PTE_P;
+	swap_free(slot);
+	return 0;
+}
+
+//
+// page_lookup, but bringing the page back from swap first if it is
+// out.  Returns 0 if nothing is mapped at va, or there is no memory
+// for the page.
+//
+struct Page *
+swap_lookup(Pde *pgdir, u_long va, Pte **ppte)
+{
+	struct Page *pp;
+
+	if ((pp = page_lookup(pgdir, va, ppte)) == 0
+	    && swap_in(pgdir, va) == 0)
+		pp = page_lookup(pgdir, va, ppte);
+	return pp;
+}
+
+void
+swap_stats(struct Swap_stats *ss)
+{
+	*ss = stats;
+}
@@ -0,0 +1,52 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef _KERN_SWAP_H_
+#define _KERN_SWAP_H_
+
+#include <inc/types.h>
+#include <inc/pmap.h>
+
+//
+// Swapping of user pages to the second IDE disk.
+//
+// When page_alloc runs out of memory it calls swap_out(), which
+// sweeps a clock hand over the environments' user page tables,
+// clearing the accessed bits it finds set and writing out the first
+// page it finds with the bits of all its mappings still clear.  The
+// reverse map finds those mappings.  Each PTE is left non-present,
+// holding the swap slot and the page's permissions with PTE_SWAPPED
+// set; it still counts in its page table's pp_ptes.
+// page_fault_handler() reads the page back with swap_in() on the
+// next touch through it.
+//
+// A slot's reference count is the number of PTEs naming it, so a
+// swapped-out page survives fork like a present one.
+//
+
+#define SWAP_DISK	1		// the slave on the primary channel
+#define SWAP_MAXSLOTS	65535		// slots fit in swap_map's u_shorts
+
+// Swapped-out PTEs
+#define SWAP_PTE(slot, perm) \
+	(((Pte)(slot) << PGSHIFT) | ((perm) & PTE_USER & ~PTE_P) | PTE_SWAPPED)
+#define SWAP_SLOT(pte)	((u_int)(PTE_ADDR(pte) >> PGSHIFT))
+#define PTE_ISSWAPPED(pte)	(((pte) & (PTE_P | PTE_SWAPPED)) == PTE_SWAPPED)
+
+struct Swap_stats {
+	u_int ss_nslots;		// slots on the disk
+	u_int ss_inuse;			// slots holding a page
+	u_long ss_nin;			// pages read back
+	u_long ss_nout;			// pages written out
+	u_int64_t ss_cycles_in;		// time spent reading them
+	u_int64_t ss_cycles_out;	// time spent writing them
+};
+
+void swap_init(void);
+int  swap_out(void);
+int  swap_in(Pde *pgdir, u_long va);
+struct Page *swap_lookup(Pde *pgdir, u_long va, Pte **ppte);
+void swap_dup(u_int slot);
+void swap_free(u_int slot);
+void swap_stats(struct Swap_stats *);
+
+#endif /* !_KERN_SWAP_H_ */
@@ -11,6 +11,8 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/vma.h>
+#include <kern/swap.h>
 
 // print a string to the system console.
 static void
@@ -58,6 +60,34 @@ sys_env_destroy(u_int envid)
 	return 0;
 }
 
+// Check the permissions a user asks for in a new mapping:
+// PTE_U|PTE_P are required, PTE_W and the PTE_AVAIL bits in PTE_USER
+// are optional, and nothing else is allowed.  In particular users
+// cannot set PTE_SWAPPED.
+static int
+bad_perm(u_int perm)
+{
+	return (perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P)
+		|| (perm & ~PTE_USER) != 0;
+}
+
+// Length of the user string s, or -E_INVAL if it is longer than max
+// or not all readable by the current environment.
+static int
+user_strlen(const char *s, int max)
+{
+	int n;
+
+	for (n = 0; n <= max; n++) {
+		if ((n == 0 || PGOFF(s + n) == 0)
+		    && user_mem_check(curenv, (u_int)(s + n), 1, 0) < 0)
+			return -E_INVAL;
+		if (s[n] == 0)
+			return n;
+	}
+	return -E_INVAL;
+}
+
 // Deschedule current environment and pick a different one to run.
 static void
 sys_yield(void)
@@ -84,8 +114,22 @@ sys_yield(void)
 static int
 sys_mem_alloc(u_int envid, u_int va, u_int perm)
 {
-	// Your code here.
-	panic("sys_mem_alloc not implemented");
+	struct Env *e;
+	struct Page *pp;
+	int r;
+
+	if (va >= UTOP || PGOFF(va) || bad_perm(perm))
+		return -E_INVAL;
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	if ((r = page_alloc_user_zeroed(&pp)) < 0)
+		return r;
+	if ((r = page_insert(e->env_pgdir, pp, va, perm)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	return 0;
 }
 
 // Map the page of memory at 'srcva' in srcid's address space
@@ -100,8 +144,30 @@ sys_mem_alloc(u_int envid, u_int va, u_int perm)
 static int
 sys_mem_map(u_int srcid, u_int srcva, u_int dstid, u_int dstva, u_int perm)
 {
-	// Your code here.
-	panic("sys_mem_map not implemented");
+	struct Env *src, *dst;
+	struct Page *pp;
+	Pte *pte;
+	int r;
+
+	if (srcva >= UTOP || PGOFF(srcva) || dstva >= UTOP || PGOFF(dstva)
+	    || bad_perm(perm))
+		return -E_INVAL;
+	if ((r = envid2env(srcid, &src, 1)) < 0
+	    || (r = envid2env(dstid, &dst, 1)) < 0)
+		return r;
+
+	if ((r = page_table_own(src->env_pgdir, srcva, perm)) < 0)
+		return r;
+	if ((pp = swap_lookup(src->env_pgdir, srcva, &pte)) == 0)
+		return -E_INVAL;
+	if ((perm & PTE_W) && !(*pte & PTE_W))
+		return -E_INVAL;
+
+	// hold the page: allocating a page table could swap it out
+	pp->pp_ref++;
+	r = page_insert(dst->env_pgdir, pp, dstva, perm);
+	page_decref(pp);
+	return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'
@@ -113,8 +179,106 @@ sys_mem_map(u_int srcid, u_int srcva, u_int dstid, u_int dstva, u_int perm)
 static int
 sys_mem_unmap(u_int envid, u_int va)
 {
-	// Your code here.
-	panic("sys_mem_unmap not implemented");
+	struct Env *e;
+	int r;
+
+	if (va >= UTOP || PGOFF(va))
+		return -E_INVAL;
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	return page_remove(e->env_pgdir, va);
+}
+
+// Allocate n pages of memory at va, va+BY2PG, ... in the address
+// space of 'envid', as n calls to sys_mem_alloc would.
+// The whole range is checked before anything is allocated.
+//
+// Returns the number of pages mapped, < 0 on error.
+static int
+sys_mem_alloc_range(u_int envid, u_int va, u_int n, u_int perm)
+{
+	struct Env *e;
+	int r;
+
+	if (va >= UTOP || PGOFF(va) || n > (UTOP - va) / BY2PG
+	    || bad_perm(perm))
+		return -E_INVAL;
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	return page_alloc_range(e->env_pgdir, va, n, perm);
+}
+
+// Map the pages described by the n entries of vec from srcid's
+// address space into dstid's, as n calls to sys_mem_map would.
+// The batch may remap the pages holding its own descriptors, so they
+// are copied into the kernel MAPVEC_CHUNK at a time, and each chunk
+// is checked and applied from that copy.  The mapping stops at the
+// first bad descriptor and at the first source page that is missing
+// or would gain write access.
+//
+// Returns the number of entries mapped, < 0 on error.
+#define MAPVEC_CHUNK	32
+
+static int
+sys_mem_map_vec(u_int srcid, u_int dstid, struct Mem_mapvec *vec, u_int n)
+{
+	struct Mem_mapvec kv[MAPVEC_CHUNK];
+	struct Env *src, *dst;
+	u_int i, m, done;
+	int r;
+
+	if (n > ULIM / sizeof(vec[0]))
+		return -E_INVAL;
+	if ((r = envid2env(srcid, &src, 1)) < 0
+	    || (r = envid2env(dstid, &dst, 1)) < 0)
+		return r;
+
+	for (done = 0; done < n; done += r) {
+		m = MIN(n - done, MAPVEC_CHUNK);
+		if (user_mem_check(curenv, (u_int)(vec + done),
+				m * sizeof(kv[0]), 0) < 0) {
+			r = -E_INVAL;
+			break;
+		}
+		memcpy(kv, vec + done, m * sizeof(kv[0]));
+		for (i = 0; i < m; i++)
+			if (kv[i].mv_srcva >= UTOP || PGOFF(kv[i].mv_srcva)
+			    || kv[i].mv_dstva >= UTOP || PGOFF(kv[i].mv_dstva)
+			    || bad_perm(kv[i].mv_perm))
+				break;
+		if (i == 0) {
+			r = -E_INVAL;
+			break;
+		}
+		r = page_map_vec(src->env_pgdir, dst->env_pgdir, kv, i);
+		if (r < 0)
+			break;
+		if (r < m) {
+			done += r;
+			break;
+		}
+	}
+	return done > 0 ? done : r;
+}
+
+// Unmap the n pages at va, va+BY2PG, ... in the address space of
+// 'envid', as n calls to sys_mem_unmap would.
+//
+// Returns n on success, < 0 on error.
+static int
+sys_mem_unmap_range(u_int envid, u_int va, u_int n)
+{
+	struct Env *e;
+	int r;
+
+	if (va >= UTOP || PGOFF(va) || n > (UTOP - va) / BY2PG)
+		return -E_INVAL;
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	return page_remove_range(e->env_pgdir, va, n);
 }
 
 // Allocate a new environment.
@@ -128,8 +292,161 @@ sys_mem_unmap(u_int envid, u_int va)
 static int
 sys_env_alloc(void)
 {
-	// Your code here (in lab 4).
-	panic("sys_env_alloc not implemented");
+	struct Env *e;
+	int r;
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+
+	// the parent will copy the pages it has; the regions fill in
+	// the ones it hasn't touched yet
+	if ((r = vma_copy(e, curenv)) < 0) {
+		env_free(e);
+		return r;
+	}
+
+	e->env_status = ENV_NOT_RUNNABLE;
+	e->env_tf = *UTF;
+	e->env_tf.tf_eax = 0;
+	return e->env_id;
+}
+
+// Fork the current environment.
+//
+// Like sys_env_alloc, except that the child gets the parent's whole
+// user address space, shared copy-on-write, and is left runnable.
+// The page tables themselves are shared; page_fault_handler() gives
+// either side its own copy of a shared page table, and then of a
+// shared page, when it first writes to it.
+//
+// Returns envid of new environment (0 in the child), or < 0 on error.
+static int
+sys_fork(void)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+
+	// The child shares the parent's stack instead of the fresh one
+	// env_alloc gave it.
+	page_remove(e->env_pgdir, USTACKTOP - BY2PG);
+	pgdir_share_cow(e->env_pgdir, curenv->env_pgdir);
+	if ((r = vma_copy(e, curenv)) < 0) {
+		env_free(e);
+		return r;
+	}
+
+	e->env_tf = *UTF;
+	e->env_tf.tf_eax = 0;
+	e->env_pgfault_entry = curenv->env_pgfault_entry;
+	return e->env_id;
+}
+
+// Limits on the arguments sys_spawn passes, which go on the one
+// page of stack a new environment starts with.
+#define SPAWN_MAXARGS	32		// number of arguments
+#define SPAWN_MAXARGLEN	(BY2PG/4)	// bytes of argument strings
+
+// Copy the argc strings in argv, which take len bytes with their
+// terminators, to the top of e's stack, and leave e's stack pointer
+// at argc and argv there, where lib/entry.S looks for them.
+static int
+spawn_args(struct Env *e, char **argv, int argc, int len)
+{
+	struct Page *p;
+	u_long delta;
+	u_int top, uargv;
+	void *kva;
+	int i, n;
+
+	// the kernel address of user stack address va is va + delta;
+	// loading the program may have swapped the page out already,
+	// and faulting in argv could swap it out again, so hold it
+	if ((p = swap_lookup(e->env_pgdir, USTACKTOP - BY2PG, 0)) == 0)
+		return -E_NO_MEM;
+	p->pp_ref++;
+	kva = page_kmap(p);
+	delta = (u_long)kva - (USTACKTOP - BY2PG);
+
+	top = USTACKTOP;
+	uargv = ROUNDDOWN(top - len, 4) - (argc + 1) * sizeof(u_int);
+	for (i = 0; i < argc; i++) {
+		n = strlen(argv[i]) + 1;
+		top -= n;
+		memcpy((void *)(top + delta), argv[i], n);
+		((u_int *)(uargv + delta))[i] = top;
+	}
+	((u_int *)(uargv + delta))[argc] = 0;
+
+	e->env_tf.tf_esp = uargv - 2 * sizeof(u_int);
+	((u_int *)(e->env_tf.tf_esp + delta))[0] = argc;
+	((u_int *)(e->env_tf.tf_esp + delta))[1] = uargv;
+	page_kunmap(kva);
+	page_decref(p);
+	return 0;
+}
+
+// Start the user program 'name', one of those linked into the
+// kernel, in a new child environment and mark it runnable.
+// argv is a null-terminated array of argument strings for it,
+// or null for none.
+//
+// Returns envid of new environment, or < 0 on error.
+static int
+sys_spawn(const char *name, char **argv)
+{
+	struct Env *e;
+	int argc, len, n, r;
+
+	if (user_strlen(name, BY2PG) < 0)
+		return -E_INVAL;
+
+	argc = len = 0;
+	for (; argv; argc++) {
+		if (argc > SPAWN_MAXARGS
+		    || user_mem_check(curenv, (u_int)&argv[argc],
+				sizeof(argv[0]), 0) < 0)
+			return -E_INVAL;
+		if (argv[argc] == 0)
+			break;
+		if ((n = user_strlen(argv[argc], SPAWN_MAXARGLEN)) < 0)
+			return n;
+		len += n + 1;
+	}
+	if (len > SPAWN_MAXARGLEN)
+		return -E_INVAL;
+
+	if ((r = env_spawn(&e, name, curenv->env_id)) < 0)
+		return r;
+	if ((r = spawn_args(e, argv, argc, len)) < 0) {
+		env_free(e);
+		return r;
+	}
+	return e->env_id;
+}
+
+// Reserve [va, va+len) in the current environment's address space
+// for pages with permission 'perm' (as in sys_mem_alloc), allocated
+// zeroed only when first touched.  Reads of untouched pages share a
+// single zero page.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va or len is not page-aligned, the range is empty,
+//		not below UTOP or overlaps a range reserved already,
+//		or perm is inappropriate.
+//	-E_NO_MEM if there's no memory to record the range.
+static int
+sys_vm_reserve(u_int va, u_int len, u_int perm)
+{
+	if (PGOFF(va) || PGOFF(len) || len == 0 || va >= UTOP
+	    || len > UTOP - va || bad_perm(perm))
+		return -E_INVAL;
+	if (vma_overlap(curenv, va, va + len))
+		return -E_INVAL;
+
+	return vma_add(curenv, va, va + len, perm, 0, 0);
 }
 
 // Set envid's trap frame to tf.
@@ -158,8 +475,16 @@ sys_set_trapframe(u_int envid, struct Trapframe *tf)
 static int
 sys_set_status(u_int envid, u_int status)
 {
-	// Your code here (in lab 4).
-	panic("sys_set_status not implemented");
+	struct Env *e;
+	int r;
+
+	if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
+		return -E_INVAL;
+	if ((r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	e->env_status = status;
+	return 0;
 }
 
 // Set envid's pagefault handler entry point and exception stack.
@@ -199,8 +524,39 @@ sys_set_pgfault_entry(u_int envid, u_int func)
 static int
 sys_ipc_can_send(u_int envid, u_int value, u_int srcva, u_int perm)
 {
-	// Your code here
-	panic("sys_ipc_can_send not implemented");
+	struct Env *e;
+	struct Page *pp;
+	Pte *pte;
+	int r;
+
+	if ((r = envid2env(envid, &e, 0)) < 0)
+		return r;
+	if (!e->env_ipc_recving)
+		return -E_IPC_NOT_RECV;
+
+	e->env_ipc_perm = 0;
+	if (srcva != 0 && e->env_ipc_dstva != 0) {
+		if (srcva >= UTOP || PGOFF(srcva) || bad_perm(perm))
+			return -E_INVAL;
+		if ((r = page_table_own(curenv->env_pgdir, srcva, perm)) < 0)
+			return r;
+		if ((pp = swap_lookup(curenv->env_pgdir, srcva, &pte)) == 0)
+			return -E_INVAL;
+		if ((perm & PTE_W) && !(*pte & PTE_W))
+			return -E_INVAL;
+		pp->pp_ref++;
+		r = page_insert(e->env_pgdir, pp, e->env_ipc_dstva, perm);
+		page_decref(pp);
+		if (r < 0)
+			return r;
+		e->env_ipc_perm = perm;
+	}
+
+	e->env_ipc_recving = 0;
+	e->env_ipc_from = curenv->env_id;
+	e->env_ipc_value = value;
+	e->env_status = ENV_RUNNABLE;
+	return 0;
 }
 
 // Block until a value is ready.  Record that you want to receive,
@@ -212,8 +568,13 @@ sys_ipc_can_send(u_int envid, u_int value, u_int srcva, u_int perm)
 static void
 sys_ipc_recv(u_int dstva)
 {
-	// Your code here
-	panic("sys_ipc_recv not implemented");
+	if (dstva >= UTOP || PGOFF(dstva))
+		dstva = 0;
+
+	curenv->env_ipc_dstva = dstva;
+	curenv->env_ipc_recving = 1;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_yield();
 }
 
 
@@ -223,15 +584,48 @@ syscall(u_int sn, u_int a1, u_int a2, u_int a3, u_int a4, u_int a5)
 {
 	// printf("syscall %d %x %x %x from env %08x\n", sn, a1, a2, a3, curenv->env_id);
 
-	// Your code here
-	//panic("syscall not implemented");
-	if(sn == SYS_cputs)
-	{
-		sys_cputs((char*)a1);
-	}
-	else
+	switch (sn) {
+	case SYS_cputs:
+		sys_cputs(TRUP((char*)a1));
+		return 0;
+	case SYS_cgetc:
+		return sys_cgetc();
+	case SYS_getenvid:
+		return sys_getenvid();
+	case SYS_env_destroy:
+		return sys_env_destroy(a1);
+	case SYS_yield:
+		sys_yield();
+		return 0;
+	case SYS_mem_alloc:
+		return sys_mem_alloc(a1, a2, a3);
+	case SYS_mem_map:
+		return sys_mem_map(a1, a2, a3, a4, a5);
+	case SYS_mem_unmap:
+		return sys_mem_unmap(a1, a2);
+	case SYS_env_alloc:
+		return sys_env_alloc();
+	case SYS_set_status:
+		return sys_set_status(a1, a2);
+	case SYS_ipc_can_send:
+		return sys_ipc_can_send(a1, a2, a3, a4);
+	case SYS_ipc_recv:
+		sys_ipc_recv(a1);
+		return 0;
+	case SYS_fork:
+		return sys_fork();
+	case SYS_mem_alloc_range:
+		return sys_mem_alloc_range(a1, a2, a3, a4);
+	case SYS_mem_map_vec:
+		return sys_mem_map_vec(a1, a2, (struct Mem_mapvec *)a3, a4);
+	case SYS_mem_unmap_range:
+		return sys_mem_unmap_range(a1, a2, a3);
+	case SYS_spawn:
+		return sys_spawn((const char *)a1, (char **)a2);
+	case SYS_vm_reserve:
+		return sys_vm_reserve(a1, a2, a3);
+	default:
 		return -E_INVAL;
-
-	
+	}
 }
 
@@ -1,6 +1,7 @@
 
 #include <inc/mmu.h>
 #include <inc/x86.h>
+#include <inc/error.h>
 #include <inc/assert.h>
 
 #include <kern/pmap.h>
@@ -12,13 +13,19 @@
 #include <kern/sched.h>
 #include <kern/kclock.h>
 #include <kern/picirq.h>
+#include <kern/vma.h>
+#include <kern/swap.h>
+#include <kern/ws.h>
 
 u_int page_fault_mode = PFM_NONE;
 static struct Taskstate ts;
 
 extern int myint0;
+extern int myint3;
+extern int myint13;
 extern int myint14;
 extern int myint30;
+extern u_int myirqs[MAX_IRQS];
 
 /* Interrupt descriptor table.  (Must be built at run time because
  * shifted function addresses can't be represented in relocation records.)
@@ -71,6 +78,7 @@ void
 idt_init(void)
 {
 	extern struct Segdesc gdt[];
+	int i;
 
 	// Setup a TSS so that we get the right stack
 	// when we trap to the kernel.
@@ -83,14 +91,16 @@ idt_init(void)
 					sizeof(struct Taskstate), 0);
 	gdt[GD_TSS >> 3].sd_s = 0;
 
-	printf("????????????????????????\n");
 	// Load the TSS
 	ltr(GD_TSS);
 
-	idt[0x0] = GATE(STS_IG32, GD_KT, (int)&myint0, 3);
-	idt[0xE] = GATE(STS_IG32, GD_KT, (int)&myint14, 3);
-	idt[0x30] = GATE(STS_IG32, GD_KT, (int)&myint30, 3);
-	printf("????????????????????????%x\n", idt[0x30]);
+	idt[T_DIVIDE] = GATE(STS_IG32, GD_KT, (int)&myint0, 3);
+	idt[T_BRKPT] = GATE(STS_IG32, GD_KT, (int)&myint3, 3);
+	idt[T_GPFLT] = GATE(STS_IG32, GD_KT, (int)&myint13, 0);
+	idt[T_PGFLT] = GATE(STS_IG32, GD_KT, (int)&myint14, 0);
+	idt[T_SYSCALL] = GATE(STS_IG32, GD_KT, (int)&myint30, 3);
+	for (i = 0; i < MAX_IRQS; i++)
+		idt[IRQ_OFFSET+i] = GATE(STS_IG32, GD_KT, myirqs[i], 0);
 	// Load the IDT
 	asm volatile("lidt idt_pd+2");
 
@@ -128,17 +138,30 @@ trap(struct Trapframe *tf)
 	// Handle processor exceptions
 	// Your code here.
 
-	if(tf->tf_trapno == 0xE)
+	if (tf->tf_trapno == T_PGFLT) {
 		page_fault_handler(tf);
-	else if(tf->tf_trapno == T_SYSCALL)
-	{
-		syscall(tf->tf_eax, tf->tf_edx, tf->tf_ecx, tf->tf_ebx, tf->tf_esi, tf->tf_edi);
+		return;
+	}
+	if (tf->tf_trapno == T_BRKPT) {
+		monitor(tf);
+		return;
+	}
+	if (tf->tf_trapno == T_SYSCALL) {
+		tf->tf_eax = syscall(tf->tf_eax, tf->tf_edx, tf->tf_ecx,
+			tf->tf_ebx, tf->tf_edi, tf->tf_esi);
+		return;
 	}
 	// Handle external interrupts
 	if (tf->tf_trapno == IRQ_OFFSET+0) {
 		// irq 0 -- clock interrupt
+		ws_tick();
+		env_reap(ENV_REAP_TICK);
 		sched_yield();
 	}
+	if (tf->tf_trapno == IRQ_OFFSET+1) {
+		kbd_intr();
+		return;
+	}
 	if (tf->tf_trapno == IRQ_OFFSET+4) {
 		serial_intr();
 		return;
@@ -167,10 +190,31 @@ void
 page_fault_handler(struct Trapframe *tf)
 {
 	u_int fault_va;
+	int r;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
 
+	// Swapped-out pages are read back in, and missing pages of the
+	// environment's regions filled in, also when it is the kernel
+	// touching user memory for it.  A page that is swapped out but
+	// can't be read back must not be filled in afresh over its slot.
+	if (!(tf->tf_err & FEC_PR) && curenv && fault_va < UTOP
+	    && ((r = swap_in(curenv->env_pgdir, fault_va)) == 0
+		|| (r == -E_INVAL
+		    && vma_fault(curenv, fault_va, tf->tf_err & FEC_WR) == 0)))
+		return;
+
+	// Other kernel-mode faults are bugs.
+	if ((tf->tf_cs & 3) == 0)
+		panic("kernel fault va %08x ip %08x", fault_va, tf->tf_eip);
+
+	// Writes to copy-on-write pages are resolved right here,
+	// without bothering the environment.
+	if ((tf->tf_err & FEC_WR) && fault_va < UTOP
+	    && page_cow_fault(curenv->env_pgdir, fault_va) == 0)
+		return;
+
 
 	// User-mode exception - destroy the environment.
 	printf("[%08x] user fault va %08x ip %08x\n",
@@ -0,0 +1,186 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
+#include <kern/image.h>
+#include <kern/vma.h>
+
+static struct Kmem_cache *vma_cache;	// where struct Vmas come from
+static struct Page *zero_page;		// mapped for reads of fresh memory
+
+void
+vma_init(void)
+{
+	vma_cache = kmem_cache_create("vma", sizeof(struct Vma),
+		sizeof(void *), 0);
+	if (vma_cache == 0 || page_alloc_zeroed(&zero_page) < 0)
+		panic("vma_init: out of memory");
+	// our reference keeps it from ever being made writable in place
+	zero_page->pp_ref = 1;
+}
+
+//
+// Add the region [start, end) to e, with pages mapped with perm and
+// filled from the ELF image binary (or zero-filled, if binary is 0).
+// start and end must be page-aligned.  flags are VMA_* flags.
+//
+// RETURNS
+//   0 on success
+//   -E_NO_MEM, if there is no memory
+//
+int
+vma_add(struct Env *e, u_int start, u_int end, u_int perm, u_int flags,
+	u_char *binary)
+{
+	struct Vma *vm;
+
+	assert(PGOFF(start) == 0 && PGOFF(end) == 0 && start < end);
+	if ((vm = kmem_cache_alloc(vma_cache)) == 0)
+		return -E_NO_MEM;
+	vm->vm_start = start;
+	vm->vm_end = end;
+	vm->vm_perm = perm;
+	vm->vm_flags = flags;
+	vm->vm_binary = binary;
+	LIST_INSERT_HEAD(&e->env_vmas, vm, vm_link);
+	return 0;
+}
+
+//
+// Return the region of e that contains va, or 0 if there is none.
+//
+struct Vma *
+vma_find(struct Env *e, u_int va)
+{
+	struct Vma *vm;
+
+	LIST_FOREACH(vm, &e->env_vmas, vm_link)
+		if (vm->vm_start <= va && va < vm->vm_end)
+			return vm;
+	return 0;
+}
+
+//
+// Return a region of e that overlaps [start, end), or 0 if none does.
+//
+struct Vma *
+vma_overlap(struct Env *e, u_int start, u_int end)
+{
+	struct Vma *vm;
+
+	LIST_FOREACH(vm, &e->env_vmas, vm_link)
+		if (vm->vm_start < end && start < vm->vm_end)
+			return vm;
+	return 0;
+}
+
+//
+// Extend the VMA_GROWSDOWN region of e just above va down to va's
+// page, if it may grow that far.  Returns the region, or 0.
+//
+static struct Vma *
+vma_grow(struct Env *e, u_int va)
+{
+	struct Vma *vm, *stack = 0;
+
+	LIST_FOREACH(vm, &e->env_vmas, vm_link)
+		if ((vm->vm_flags & VMA_GROWSDOWN) && vm->vm_start > va
+		    && (stack == 0 || vm->vm_start < stack->vm_start))
+			stack = vm;
+	if (stack == 0 || stack->vm_end - va > USTACKSIZE)
+		return 0;
+	// keep a guard page between it and whatever is below
+	if (va < BY2PG || vma_overlap(e, va - BY2PG, stack->vm_start))
+		return 0;
+	stack->vm_start = va;
+	return stack;
+}
+
+//
+// Map the page of e containing va, which is missing, if it lies in
+// one of e's regions or a stack may grow down to it.  write says
+// whether the page is wanted for writing.
+//
+// RETURNS
+//   0 on success
+//   -E_INVAL, if va is in no region
+//   -E_NO_MEM, if there is no memory
+//
+int
+vma_fault(struct Env *e, u_int va, int write)
+{
+	struct Vma *vm;
+	struct Page *pp;
+	u_int perm;
+	void *kva;
+	int r;
+
+	va = ROUNDDOWN(va, BY2PG);
+	if ((vm = vma_find(e, va)) == 0 && (vm = vma_grow(e, va)) == 0)
+		return -E_INVAL;
+
+	// Reading untouched anonymous memory costs no memory of its own;
+	// the first write copies the zero page like any other
+	// copy-on-write page.
+	if (!write && vm->vm_binary == 0) {
+		perm = vm->vm_perm;
+		if (perm & PTE_W)
+			perm = (perm & ~PTE_W) | PTE_COW;
+		return page_insert(e->env_pgdir, zero_page, va, perm);
+	}
+
+	if ((r = page_alloc_user_zeroed(&pp)) < 0)
+		return r;
+	if (vm->vm_binary) {
+		kva = page_kmap(pp);
+		image_fill(vm->vm_binary, va, kva);
+		page_kunmap(kva);
+	}
+	if ((r = page_insert(e->env_pgdir, pp, va, vm->vm_perm)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	return 0;
+}
+
+//
+// Replace dst's regions with a copy of each of src's, for fork: the
+// pages src has not touched yet are then filled in the same way in
+// dst.
+//
+// RETURNS
+//   0 on success
+//   -E_NO_MEM, if there is no memory; dst may have some of them
+//
+int
+vma_copy(struct Env *dst, struct Env *src)
+{
+	struct Vma *vm;
+	int r;
+
+	vma_free_all(dst);
+	LIST_FOREACH(vm, &src->env_vmas, vm_link)
+		if ((r = vma_add(dst, vm->vm_start, vm->vm_end,
+				vm->vm_perm, vm->vm_flags, vm->vm_binary)) < 0)
+			return r;
+	return 0;
+}
+
+//
+// Drop all of e's regions.  The pages in them are not touched.
+//
+void
+vma_free_all(struct Env *e)
+{
+	struct Vma *vm;
+
+	while ((vm = LIST_FIRST(&e->env_vmas)) != 0) {
+		LIST_REMOVE(vm, vm_link);
+		kmem_cache_free(vma_cache, vm);
+	}
+}
@@ -0,0 +1,45 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef _KERN_VMA_H_
+#define _KERN_VMA_H_
+
+#include <inc/env.h>
+
+//
+// Virtual memory regions: ranges of an environment's address space
+// whose pages are only allocated when first touched.
+//
+// page_fault_handler() fills a missing page that lies in one of the
+// environment's regions with a zeroed page, into which the parts of
+// the region's ELF image (if any) that cover the page are copied,
+// and maps it with the region's permissions.  A read of a page with
+// no image behind it just maps the shared zero page, copy-on-write
+// if the region is writable.
+//
+// A VMA_GROWSDOWN region (the user stack) is extended down to cover
+// faults below it, up to USTACKSIZE bytes in all, as long as that
+// leaves a page free above the next region down.
+//
+
+struct Vma {
+	u_int vm_start;			// first address, page-aligned
+	u_int vm_end;			// one past the last, page-aligned
+	u_int vm_perm;			// PTE permissions of its pages
+	u_int vm_flags;			// VMA_*
+	u_char *vm_binary;		// ELF image to fill pages from, or 0
+	LIST_ENTRY(Vma) vm_link;	// link on env_vmas
+};
+
+// vm_flags
+#define VMA_GROWSDOWN	0x1		// grows down on faults below it
+
+void vma_init(void);
+int  vma_add(struct Env *, u_int start, u_int end, u_int perm,
+		u_int flags, u_char *binary);
+struct Vma *vma_find(struct Env *, u_int va);
+struct Vma *vma_overlap(struct Env *, u_int start, u_int end);
+int  vma_fault(struct Env *, u_int va, int write);
+int  vma_copy(struct Env *dst, struct Env *src);
+void vma_free_all(struct Env *);
+
+#endif /* !_KERN_VMA_H_ */
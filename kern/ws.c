@@ -0,0 +1,152 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/ws.h>
+
+static struct Ws_stats stats;
+
+static u_long ticks;		// clock ticks so far
+static u_long lap_start;	// tick the current or last lap began at
+static int scanning;		// a lap is under way
+
+// The scan cursor, and what it has counted in the env it is in.
+static struct Pte_hand hand;
+static u_int scan_env;
+static u_int scan_envid;	// env_id of envs[scan_env] when we got there
+static u_int scan_ref, scan_dirty, scan_rss;
+static struct Page *scan_table;	// the shared table it is counting first
+
+//
+// Start counting for the env the hand has just moved to.
+//
+static void
+ws_enter(void)
+{
+	scan_env = hand.ph_env;
+	scan_envid = envs[scan_env].env_id;
+	scan_ref = scan_dirty = scan_rss = 0;
+	scan_table = 0;
+}
+
+//
+// Done with envs[scan_env]: age its working set with what we counted,
+// unless it exited while we were in it.
+//
+static void
+ws_leave(void)
+{
+	struct Env *e = &envs[scan_env];
+
+	if (e->env_status == ENV_FREE || e->env_id != scan_envid)
+		return;
+	e->env_ws_ref = scan_ref;
+	e->env_ws_dirty = scan_dirty;
+	e->env_rss = scan_rss;
+	if (scan_ref >= e->env_ws)
+		e->env_ws = scan_ref;
+	else
+		e->env_ws -= (e->env_ws - scan_ref + 3) / 4;
+}
+
+//
+// Sample one PTE, clearing its accessed and dirty bits and handing
+// them on to the page's other scanners.
+// A page table shared since fork is sampled only by the first of its
+// sharers the hand reaches in a lap; it leaves what it counted in the
+// pages for the later ones, so that each is credited the same pages.
+//
+static void
+ws_pte(struct Env *e, Pte *pte, u_long va)
+{
+	struct Page *pp, *tp;
+	int ref, dirty;
+
+	pp = pte2page(*pte);
+	tp = pte2table(pte);
+	if (tp->pp_ref > 1 && tp != scan_table
+	    && tp->pp_ptmap == stats.ws_laps + 1) {
+		ref = (pp->pp_flags & PG_WS_SA) != 0;
+		dirty = (pp->pp_flags & PG_WS_SD) != 0;
+		goto count;
+	}
+
+	ref = (*pte & PTE_A) || (pp->pp_flags & PG_WS_A);
+	dirty = (*pte & PTE_D) || (pp->pp_flags & PG_WS_D);
+	pp->pp_flags &= ~(PG_WS_A | PG_WS_D);
+	if (*pte & PTE_A)
+		pp->pp_flags |= PG_SWAP_A;
+	if (*pte & PTE_D)
+		pp->pp_flags |= PG_KSM_D;
+	if (*pte & (PTE_A | PTE_D)) {
+		*pte &= ~(PTE_A | PTE_D);
+		tlb_invalidate_pte(e->env_pgdir, pte, va);
+	}
+	if (tp->pp_ref > 1) {
+		tp->pp_ptmap = stats.ws_laps + 1;
+		scan_table = tp;
+		pp->pp_flags &= ~(PG_WS_SA | PG_WS_SD);
+		if (ref)
+			pp->pp_flags |= PG_WS_SA;
+		if (dirty)
+			pp->pp_flags |= PG_WS_SD;
+	}
+
+count:
+	scan_rss++;
+	scan_ref += ref;
+	scan_dirty += dirty;
+	stats.ws_scanned++;
+}
+
+//
+// Look at the next n user PTEs of the current lap.
+//
+static void
+ws_scan(u_int n)
+{
+	Pte *pte;
+	u_long va;
+
+	while (n-- > 0) {
+		switch (pte_hand_step(&hand, &pte, &va)) {
+		case PH_LAP:
+			ws_leave();
+			scanning = 0;
+			stats.ws_laps++;
+			return;
+		case PH_NEXT:
+			ws_leave();
+			ws_enter();
+			break;
+		case PH_PTE:
+			ws_pte(&envs[scan_env], pte, va);
+			break;
+		}
+	}
+}
+
+//
+// Called on every clock interrupt.
+//
+void
+ws_tick(void)
+{
+	ticks++;
+	if (!scanning) {
+		if (ticks - lap_start < WS_INTERVAL)
+			return;
+		lap_start = ticks;
+		scanning = 1;
+		ws_enter();
+	}
+	ws_scan(WS_BATCH);
+}
+
+void
+ws_stats(struct Ws_stats *ws)
+{
+	*ws = stats;
+}
@@ -0,0 +1,35 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef _KERN_WS_H_
+#define _KERN_WS_H_
+
+#include <inc/types.h>
+
+//
+// Working-set estimation.  The clock interrupt walks the environments'
+// user PTEs, counting and clearing the accessed and dirty bits, and
+// keeps in each struct Env how many pages it touched (env_ws_ref),
+// wrote (env_ws_dirty) and had mapped (env_rss) during the last lap.
+//
+// env_ws ages the samples: it follows a larger one at once and falls
+// back towards a smaller one by a quarter of the difference a lap, so
+// a short idle spell does not hide what an environment will want
+// again.  All of it can be read through UENVS.
+//
+// A lap starts at most every WS_INTERVAL ticks and looks at WS_BATCH
+// PTEs a tick until it has covered every environment.  Bits cleared
+// here are passed on to swap_out() and ksm_scan() through pp_flags.
+//
+
+struct Ws_stats {
+	u_long ws_laps;			// full passes over all the envs
+	u_long ws_scanned;		// present PTEs looked at
+};
+
+#define WS_INTERVAL	10		// clock ticks between laps
+#define WS_BATCH	1024		// PTEs looked at per tick
+
+void ws_tick(void);
+void ws_stats(struct Ws_stats *);
+
+#endif /* !_KERN_WS_H_ */
@@ -1,10 +1,12 @@
 #include <inc/x86.h>
 #include <inc/pmap.h>
+#include <inc/string.h>
+#include <inc/disk.h>
 
 void
 notbusy(void)
 {
-        while(inb(0x1F7) & 0x80);       // wait for disk not busy
+        while((inb(0x1F7) & 0xC0) != 0x40);     // wait for disk ready
 }
 
 
@@ -25,82 +27,115 @@ readsect(u_char *dst, u_int count, u_int offset)
         insl(0x1F0, dst, count*512/4);
 }
 
-// read count bytes at offset from kernel into addr dst
-// might copy more than asked
-/*
+// read count bytes at offset from the kernel image on disk into va.
+// The boot loader no longer leaves the whole image in low memory,
+// so go back to the disk a sector at a time.
 void
 readseg_kern(u_int va, u_int count, u_int offset)
 {
-        u_int i;
-
-
-	count += (offset & 511); 
-
-        // translate from bytes to sectors
-        offset /= 512;
-
-	// count += (offset & 511);  fucking order, offset should not change for this computation
-
-	// read more bytes
-        count = (count+511)/512;
-
-	count++;
-
-        // kernel starts at sector 1
-        offset++;
-
-        // if this is too slow, we could read lots of sectors at a time.
-        // we'd write more to memory than asked, but it doesn't matter --
-        // we load in increasing order.
-        for(i=0; i<count; i++){
-                readsect((u_char*)va, 1, offset+i);
-                va += 512;
-        }
+	u_char buf[512];
+	u_int n;
+
+	while (count > 0) {
+		// kernel starts at sector 1
+		readsect(buf, 1, offset/512 + 1);
+		n = MIN(512 - offset%512, count);
+		memcpy((void*)va, buf + offset%512, n);
+		va += n;
+		offset += n;
+		count -= n;
+	}
 }
-*/
 
 
-void
-readseg_kern(u_int va, u_int count, u_int offset)
+//
+// Wait for the controller to finish a command.
+// Returns the status, or -1 if the command failed.
+//
+static int
+ide_wait(void)
 {
-        u_int i, j;
+	int r;
+
+	while (((r = inb(0x1F7)) & (IDE_BSY | IDE_DRDY)) != IDE_DRDY)
+		if ((r & (IDE_BSY | IDE_ERR)) == IDE_ERR || r == 0xFF)
+			return -1;
+	if (r & (IDE_DF | IDE_ERR))
+		return -1;
+	return r;
+}
 
-	char* sect = (char*)(KERNBASE+0x7E00);
+// Start command cmd on nsecs sectors of diskno from secno.
+static void
+ide_start(u_int diskno, u_int secno, u_int nsecs, u_int cmd)
+{
+	outb(0x1F2, nsecs);
+	outb(0x1F3, secno);
+	outb(0x1F4, secno >> 8);
+	outb(0x1F5, secno >> 16);
+	outb(0x1F6, 0xE0 | ((diskno & 1) << 4) | ((secno >> 24) & 0x0F));
+	outb(0x1F7, cmd);
+}
 
-	printf("offset = %x\n", offset);
+//
+// Ask diskno to identify itself.
+// Returns the number of sectors it can address with LBA,
+// or 0 if there is no such disk.
+//
+u_int
+ide_nsectors(u_int diskno)
+{
+	u_short id[SECTSIZE / 2];
+	int i;
+
+	outb(0x1F6, 0xE0 | ((diskno & 1) << 4));
+	outb(0x1F7, 0xEC);	// cmd 0xEC - identify device
+
+	// an absent drive never sets any status bits
+	for (i = 0; i < 1000 && inb(0x1F7) == 0; i++)
+		;
+	if (i == 1000 || ide_wait() < 0)
+		return 0;
+	insl(0x1F0, id, SECTSIZE / 4);
+	return id[60] | ((u_int)id[61] << 16);
+}
 
-	for(i = 0; i < count; i++)
-	{
-		*((u_char*)va + i) = *(sect + offset + i);
-		printf("%x ", *(sect + offset + i));
+//
+// Read nsecs (at most 256) sectors from diskno, starting at secno,
+// into dst.  Returns 0, or -1 on a disk error.
+//
+int
+ide_read(u_int diskno, u_int secno, void *dst, u_int nsecs)
+{
+	u_char *p = dst;
+
+	if (ide_wait() < 0)
+		return -1;
+	ide_start(diskno, secno, nsecs, 0x20);	// cmd 0x20 - read sectors
+	for (; nsecs > 0; nsecs--, p += SECTSIZE) {
+		if (ide_wait() < 0)
+			return -1;
+		insl(0x1F0, p, SECTSIZE / 4);
 	}
-
-	/*
-
-        // round down to sector boundary; offset will round later
-        i = va&511;
-        count += i;
-        va -= i;
-
-        // translate from bytes to sectors
-        offset /= 512;
-        count = (count+511)/512;
-
-        // kernel starts at sector 1
-        //offset++;
-
-        // if this is too slow, we could read lots of sectors at a time.
-        // we'd write more to memory than asked, but it doesn't matter --
-        // we load in increasing order.
-        for(i=0; i<count; i++){
-
-                for(j = 0; j < 512; j++)
-                {
-                        *((u_char*)va + j) = *((sect + offset*512 + i*512) + j);
-                }
-
-                va += 512;
-        }
-	*/
+	return 0;
 }
 
+//
+// Write nsecs (at most 256) sectors from src to diskno, starting at
+// secno.  Returns 0, or -1 on a disk error.
+//
+int
+ide_write(u_int diskno, u_int secno, const void *src, u_int nsecs)
+{
+	const u_char *p = src;
+
+	if (ide_wait() < 0)
+		return -1;
+	ide_start(diskno, secno, nsecs, 0x30);	// cmd 0x30 - write sectors
+	for (; nsecs > 0; nsecs--, p += SECTSIZE) {
+		if (ide_wait() < 0)
+			return -1;
+		outsl(0x1F0, p, SECTSIZE / 4);
+	}
+	return ide_wait() < 0 ? -1 : 0;
+}
@@ -6,21 +6,38 @@
 
 #define debug 0
 
-#define PTE_COW		0x800
+// duppage queues its mappings and hands them to the kernel this
+// many at a time with sys_mem_map_vec.
+#define DUP_BATCH	128
+
+static struct Mem_mapvec dup_child[DUP_BATCH];	// our pages for the child
+static struct Mem_mapvec dup_self[DUP_BATCH];	// ours to mark copy-on-write
+static u_int dup_nchild, dup_nself;
+
+static void
+dupqueue(struct Mem_mapvec *mv, u_int addr, u_int perm)
+{
+	mv->mv_srcva = addr;
+	mv->mv_dstva = addr;
+	mv->mv_perm = perm;
+}
 
 //
-// Custom page fault handler - if faulting page is copy-on-write,
-// map in our own private writable copy.
+// Make the mappings duppage queued.  The child's must be made
+// before ours become copy-on-write.
 //
-
 static void
-pgfault(u_int va, u_int err)
+dupflush(u_int envid)
 {
 	int r;
-	u_char *tmp;
 
-	// Your code here.
-	panic("pgfault not implemented");
+	if (dup_nchild > 0
+	    && (r = sys_mem_map_vec(0, envid, dup_child, dup_nchild)) != dup_nchild)
+		panic("duppage: %e", r < 0 ? r : -E_INVAL);
+	if (dup_nself > 0
+	    && (r = sys_mem_map_vec(0, 0, dup_self, dup_nself)) != dup_nself)
+		panic("duppage: %e", r < 0 ? r : -E_INVAL);
+	dup_nchild = dup_nself = 0;
 }
 
 //
@@ -29,30 +46,81 @@ pgfault(u_int va, u_int err)
 // the new mapping must be created copy on write and then our mapping must be
 // marked copy on write as well.  (Exercise: why mark ours copy-on-write again if
 // it was already copy-on-write?)
-// 
+// The mappings are queued; dupflush() makes them.
+//
 static void
 duppage(u_int envid, u_int pn)
 {
-	int r;
 	u_int addr;
 	Pte pte;
 
-	// Your code here.
-	panic("duppage not implemented");
+	if (dup_nchild == DUP_BATCH)
+		dupflush(envid);
+
+	addr = pn * BY2PG;
+	pte = vpt[pn];
+
+	if ((pte & (PTE_W | PTE_COW)) && !(pte & PTE_LIBRARY)) {
+		dupqueue(&dup_child[dup_nchild++], addr, PTE_U | PTE_P | PTE_COW);
+		dupqueue(&dup_self[dup_nself++], addr, PTE_U | PTE_P | PTE_COW);
+	} else
+		dupqueue(&dup_child[dup_nchild++], addr, (u_int)pte & PTE_USER);
 }
 
 //
 // User-level fork.  Create a child and then copy our address space
-// and page fault handler setup to the child.
+// to the child page by page, in batches of DUP_BATCH pages.
+// The kernel resolves the copy-on-write faults that follow, so no
+// page fault handler is needed.  fork() below does the same work in
+// a single system call; this one is kept to compare against.
+//
+int
+ufork(void)
+{
+	u_int envid, pn;
+	int r;
+
+	if ((r = sys_env_alloc()) < 0)
+		return r;
+	envid = r;
+	if (envid == 0) {
+		// our copy of the queue is from the middle of the parent's
+		env = &envs[ENVX(sys_getenvid())];
+		dup_nchild = dup_nself = 0;
+		return 0;
+	}
+
+	for (pn = 0; pn < VPN(UTOP); pn++) {
+		// skip over page tables that aren't there
+		if (!(vpd[pn / PTE2PT] & PTE_P)) {
+			pn = ROUNDDOWN(pn, PTE2PT) + PTE2PT - 1;
+			continue;
+		}
+		// pages out in swap have to come back to be shared
+		if (!(vpt[pn] & PTE_P) && (vpt[pn] & PTE_SWAPPED))
+			(void)*(volatile u_char *)(pn * BY2PG);
+		if (vpt[pn] & PTE_P)
+			duppage(envid, pn);
+	}
+	dupflush(envid);
+
+	if ((r = sys_set_status(envid, ENV_RUNNABLE)) < 0)
+		panic("ufork: %e", r);
+	return envid;
+}
+
+//
+// Copy-on-write fork, done by the kernel in one system call.
+// Remember to fix "env" in the child process!
 //
-// Hint: use vpd, vpt, and duppage.
-// Hint: remember to fix "env" in the child process!
-// 
 int
 fork(void)
 {
-	// Your code here.
-	panic("fork not implemented");
+	int r;
+
+	if ((r = sys_fork()) == 0)
+		env = &envs[ENVX(sys_getenvid())];
+	return r;
 }
 
 // Challenge!
@@ -10,8 +10,12 @@
 void
 ipc_send(u_int whom, u_int val, u_int srcva, u_int perm)
 {
-	// Your code here.
-	panic("ipc_send not implemented");
+	int r;
+
+	while ((r = sys_ipc_can_send(whom, val, srcva, perm)) == -E_IPC_NOT_RECV)
+		sys_yield();
+	if (r < 0)
+		panic("ipc_send: %e", r);
 }
 
 // Receive a value.  Return the value and store the caller's envid
@@ -21,8 +25,12 @@ ipc_send(u_int whom, u_int val, u_int srcva, u_int perm)
 u_int
 ipc_recv(u_int *whom, u_int dstva, u_int *perm)
 {
-	// Your code here
-	panic("ipc_recv not implemented");
-	return 0;
+	sys_ipc_recv(dstva);
+
+	if (whom)
+		*whom = env->env_ipc_from;
+	if (perm)
+		*perm = env->env_ipc_perm;
+	return env->env_ipc_value;
 }
 
@@ -12,7 +12,7 @@ void
 libmain(int argc, char **argv)
 {
 	// set env to point at our env structure in envs[].
-	env = 0;	// Your code here.
+	env = &envs[ENVX(sys_getenvid())];
 
 	// save the name of the program so that panic() can use it
 	if (argc > 0)
@@ -27,6 +27,7 @@ static char *error_string[MAXERROR+1] =
 	"out of environments",
 	"env is not recving",
 	"unexpected end of file",
+	"not found",
 };
 
 /*
@@ -121,3 +121,19 @@ memcpy(void *dst, const void *src, size_t n)
 	return dst;
 }
 
+
+int
+memcmp(const void *v1, const void *v2, size_t n)
+{
+	const u_char *s1, *s2;
+
+	s1 = v1;
+	s2 = v2;
+	while (n-- > 0) {
+		if (*s1 != *s2)
+			return (int)*s1 - (int)*s2;
+		s1++, s2++;
+	}
+
+	return 0;
+}
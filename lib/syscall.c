@@ -113,3 +113,39 @@ sys_ipc_recv(u_int dstva)
 	syscall(SYS_ipc_recv, dstva, 0, 0, 0, 0);
 }
 
+int
+sys_mem_alloc_range(u_int envid, u_int va, u_int n, u_int perm)
+{
+	return syscall(SYS_mem_alloc_range, envid, va, n, perm, 0);
+}
+
+int
+sys_mem_map_vec(u_int srcenv, u_int dstenv, struct Mem_mapvec *vec, u_int n)
+{
+	return syscall(SYS_mem_map_vec, srcenv, dstenv, (u_int)vec, n, 0);
+}
+
+int
+sys_mem_unmap_range(u_int envid, u_int va, u_int n)
+{
+	return syscall(SYS_mem_unmap_range, envid, va, n, 0, 0);
+}
+
+int
+sys_spawn(const char *name, char **argv)
+{
+	return syscall(SYS_spawn, (u_int)name, (u_int)argv, 0, 0, 0);
+}
+
+int
+sys_vm_reserve(u_int va, u_int len, u_int perm)
+{
+	return syscall(SYS_vm_reserve, va, len, perm, 0, 0);
+}
+
+int
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0);
+}
+
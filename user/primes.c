@@ -4,28 +4,44 @@
 // The picture halfway down the page and the text surrounding it
 // explain what's going on here.
 //
-// Since NENVS is 1024, we can print 1022 primes before running out.
-// The remaining two environments are the integer generator at the bottom
-// of main and user/idle.
+// The kernel sizes the env table from memory, up to NENV (32768)
+// environments, so we can print two fewer primes than it has envs
+// before running out.  The remaining two environments are the
+// integer generator at the bottom of main and user/idle.
+//
+// Each prime is printed with the cycles its process spent in the
+// fork() that started its right neighbor and, for comparison, in a
+// ufork() of the same address space whose child exits right away.
 
+#include <inc/x86.h>
 #include <inc/lib.h>
 
 u_int
 primeproc(void)
 {
-	int i, id, p;
-	u_int envid;
+	int i, id, uid, p;
+	u_int envid, kern, user;
+	u_int64_t t0;
 
 	// fetch a prime from our left neighbor
 top:
 	p = ipc_recv(&envid, 0, 0);
-	printf("%d ", p);
 
 	// fork a right neighbor to continue the chain
+	t0 = read_tsc();
 	if ((id = fork()) < 0)
 		panic("fork: %e", id);
 	if (id == 0)
 		goto top;
+	kern = (u_int)(read_tsc() - t0);
+
+	// once the envs run out this ufork fails and shows 0 cycles;
+	// the chain's own fork above decides when primes stops
+	t0 = read_tsc();
+	if ((uid = ufork()) == 0)
+		exit();
+	user = uid < 0 ? 0 : (u_int)(read_tsc() - t0);
+	printf("%d (fork %d, ufork %d) ", p, kern, user);
 	
 	// filter out multiples of our prime
 	for (;;) {
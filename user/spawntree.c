@@ -0,0 +1,54 @@
+// Spawn a binary tree of processes, as forktree forks one, and show
+// how long the parent spends starting each child.  The root first
+// compares that with the cost of a fork.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define DEPTH 3
+
+void
+spawnchild(char *cur, char branch)
+{
+	char nxt[DEPTH+1];
+	char *argv[3];
+	u_int64_t t0;
+	int r;
+
+	if (strlen(cur) >= DEPTH)
+		return;
+
+	snprintf(nxt, DEPTH+1, "%s%c", cur, branch);
+	argv[0] = "spawntree";
+	argv[1] = nxt;
+	argv[2] = 0;
+
+	t0 = read_tsc();
+	if ((r = sys_spawn("spawntree", argv)) < 0)
+		panic("spawn: %e", r);
+	printf("%x: spawned '%s' in %d cycles\n", sys_getenvid(), nxt,
+		(u_int)(read_tsc() - t0));
+}
+
+void
+umain(int argc, char **argv)
+{
+	char *cur = argc > 1 ? argv[1] : "";
+	u_int64_t t0;
+	int r;
+
+	printf("%x: I am '%s'\n", sys_getenvid(), cur);
+
+	if (argc < 2) {
+		t0 = read_tsc();
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0)
+			exit();
+		printf("%x: forked in %d cycles\n", sys_getenvid(),
+			(u_int)(read_tsc() - t0));
+	}
+
+	spawnchild(cur, '0');
+	spawnchild(cur, '1');
+}